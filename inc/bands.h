@@ -0,0 +1,111 @@
+#pragma once
+
+#include "image_io.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+
+// Original rows as seen by one band of a neighborhood transform working in place
+// Rows no other band writes come from the image, the band still has to keep copies of the ones it overwrites itself
+// Rows other bands write come from copies taken before any band started
+class band_rows {
+	public:
+		// Output rows [y_begin, y_end), reading up to radius rows past them
+		// No other band writes the rows [own_begin, own_end)
+		band_rows(image_io& image, int y_begin, int y_end, int radius, int own_begin, int own_end)
+			: m_image(image), m_begin(y_begin), m_end(y_end), m_own_begin(own_begin), m_own_end(own_end),
+			m_above(std::min(std::max(y_begin - radius, 0), own_begin)),
+			m_below(std::max(std::min(y_end + radius, image.height()), own_end)),
+			m_copies((size_t) (m_own_begin - m_above + m_below - m_own_end)*image.width()) {}
+
+		// Take the copies of the rows just above and below the band
+		void save() {
+			for (int y = m_above; y < m_own_begin; y++) {
+				memcpy(&m_copies[copy_index(y)], m_image.row(y), m_image.width()*sizeof(Uint32));
+			}
+
+			for (int y = m_own_end; y < m_below; y++) {
+				memcpy(&m_copies[copy_index(y)], m_image.row(y), m_image.width()*sizeof(Uint32));
+			}
+		}
+
+		// Source row y, within radius of the band
+		const Uint32* row(int y) const {
+			if (y < m_own_begin || y >= m_own_end) return &m_copies[copy_index(y)];
+
+			return m_image.row(y);
+		}
+
+		Uint32* row_dst(int y) {
+			return m_image.row(y);
+		}
+
+		int begin() const { return m_begin; }
+		int end() const { return m_end; }
+
+	private:
+		// Position of the copy of row y, the rows above the band come first
+		size_t copy_index(int y) const {
+			int index = (y < m_own_begin) ? y - m_above : m_own_begin - m_above + y - m_own_end;
+
+			return (size_t) index*m_image.width();
+		}
+
+		image_io& m_image;
+
+		int m_begin;
+		int m_end;
+		int m_own_begin;
+		int m_own_end;
+
+		// Rows readable around the band
+		int m_above;
+		int m_below;
+
+		std::vector<Uint32> m_copies;
+};
+
+// How many bands to split rows into, min_rows being the fewest rows worth giving a band
+// A few bands per thread so the ones that finish early can pick up more work
+inline int band_count(int rows, int min_rows) {
+	if (get_threads() < 2) return 1;
+
+	return std::max(std::min(4*get_threads(), rows/std::max(min_rows, 1)), 1);
+}
+
+// Split the output rows [y_begin, y_end) into horizontal bands and transform them in parallel
+// radius is how many rows past its own a band reads, min_rows the fewest rows worth giving a band
+// With one thread the whole range is a single band and nothing gets copied
+inline void run_bands(image_io& image, int y_begin, int y_end, int radius, int min_rows,
+						const std::function<void(band_rows&)>& band) {
+	if (y_end <= y_begin) return;
+
+	int count = band_count(y_end - y_begin, min_rows);
+
+	if (count < 2) {
+		band_rows rows(image, y_begin, y_end, radius, 0, image.height());
+
+		band(rows);
+
+		return;
+	}
+
+	std::vector<band_rows> bands;
+
+	for (int i = 0; i < count; i++) {
+		int band_begin = y_begin + (long) (y_end - y_begin)*i/count;
+		int band_end = y_begin + (long) (y_end - y_begin)*(i + 1)/count;
+
+		// Rows outside [y_begin, y_end) are never written, the first and last bands can read them directly
+		bands.push_back(band_rows(image, band_begin, band_end, radius,
+									(i == 0) ? 0 : band_begin, (i == count - 1) ? image.height() : band_end));
+	}
+
+	// Every copy has to be taken before any band writes
+	parallel_for(count, [&](int i) { bands[i].save(); });
+	parallel_for(count, [&](int i) { band(bands[i]); });
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "image_io.h"
+
+#include <vector>
+
+
+// Black and white image at one bit per pixel, 64 pixels to a word
+// Pixel x of a row is bit x % 64 of word x / 64, a set bit is a black pixel
+class binary_image {
+	public:
+		// All white
+		binary_image(int width, int height);
+		// Black where the gray value is 0, the way erosion and dilation see an image
+		binary_image(image_io& image_src);
+
+		int width() const { return m_width; }
+		int height() const { return m_height; }
+		// Words in a row, the bits past the width are always clear
+		int words() const { return m_words; }
+
+		Uint64* row(int y) { return &m_bits[(size_t) y*m_words]; }
+		const Uint64* row(int y) const { return &m_bits[(size_t) y*m_words]; }
+
+		bool get(int x, int y) const { return (row(y)[x >> 6] >> (x & 63)) & 1; }
+
+		// Set row y from the gray values of its pixels, black below the threshold
+		void threshold_row(int y, const Uint8* gray, Uint32 threshold);
+
+		// Expand into black (0x000000) and white (0xFFFFFF) pixels
+		void write(image_io& image_dst) const;
+
+	private:
+		int m_width;
+		int m_height;
+		int m_words;
+
+		std::vector<Uint64> m_bits;
+};
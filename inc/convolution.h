@@ -0,0 +1,153 @@
+#pragma once
+
+#include "image_io.h"
+#include "indices.h"
+
+#include <vector>
+
+
+// Kernels are applied as written, like the Sobel and Laplace masks: the tap in row i and column j weighs the pixel
+// i - height/2 rows down and j - width/2 columns across, the kernel isn't flipped
+// Sides are odd so every kernel has a center tap
+
+// Element n of the values that follow it
+constexpr int tap_pick(int, int first) {
+	return first;
+}
+
+template<class... Rest>
+constexpr int tap_pick(int n, int first, Rest... rest) {
+	return (n == 0) ? first : tap_pick(n - 1, rest...);
+}
+
+// A kernel known at compile time, Width x Height integer taps in row order
+// Whether it's separable into a column and a row, and the two factors, are worked out at compile time
+template<int Width, int Height, int... Taps>
+struct fixed_kernel {
+	static_assert(sizeof...(Taps) == Width*Height, "A fixed kernel needs Width*Height taps");
+	static_assert(Width % 2 == 1 && Height % 2 == 1, "Kernel sides have to be odd");
+
+	static const int width = Width;
+	static const int height = Height;
+
+	static constexpr int tap(int n) { return tap_pick(n, Taps...); }
+	static constexpr int tap(int i, int j) { return tap(i*Width + j); }
+
+	// First tap that isn't zero, the one the factors are taken relative to
+	static constexpr int pivot(int n = 0) { return (n == Width*Height || tap(n) != 0) ? n : pivot(n + 1); }
+
+	// The row factor is the pivot's row, the column factor the pivot's column divided by the pivot
+	// It's separable if that reproduces every tap with an integer column
+	static constexpr int row_tap(int j) { return tap(pivot()/Width, j); }
+	static constexpr int column_tap(int i) { return tap(i, pivot() % Width)/tap(pivot()); }
+
+	static constexpr bool separable(int n = 0) {
+		return pivot() < Width*Height
+			&& (n == Width*Height
+				|| (tap(n/Width, pivot() % Width) % tap(pivot()) == 0
+					&& column_tap(n/Width)*row_tap(n % Width) == tap(n)
+					&& separable(n + 1)));
+	}
+};
+
+// One weighted pixel, zero taps don't even read theirs
+template<int Tap>
+struct tap_term {
+	template<class T> static int at(const T* pixel) { return Tap*(*pixel); }
+};
+
+template<>
+struct tap_term<0> {
+	template<class T> static int at(const T*) { return 0; }
+};
+
+// Sums of tap terms, expanded over the indices at compile time
+inline int tap_sum() {
+	return 0;
+}
+
+template<class... Terms>
+inline int tap_sum(int first, Terms... rest) {
+	return first + tap_sum(rest...);
+}
+
+// Weighted sum of the 2D neighborhood of column x, rows[i] being the row i - Height/2 away
+template<class Kernel, int... I>
+inline int direct_sum(const Uint8* const* rows, int x, int_indices<I...>) {
+	return tap_sum(tap_term<Kernel::tap(I)>::at(rows[I/Kernel::width] + x + I % Kernel::width - Kernel::width/2)...);
+}
+
+// The column factor down column x, and the row factor along a row of column sums
+template<class Kernel, int... I>
+inline int column_sum(const Uint8* const* rows, int x, int_indices<I...>) {
+	return tap_sum(tap_term<Kernel::column_tap(I)>::at(rows[I] + x)...);
+}
+
+template<class Kernel, int... J>
+inline int row_sum(const int* sums, int x, int_indices<J...>) {
+	return tap_sum(tap_term<Kernel::row_tap(J)>::at(sums + x + J - Kernel::width/2)...);
+}
+
+// Sums of a kernel over a row of a plane of 8-bit values, rows[i] being the row i - Height/2 away from it
+// Only the columns [Width/2, width - Width/2) are set, scratch holds width ints for the separable form
+template<class Kernel>
+inline void convolve_row(const Uint8* const* rows, int width, int* sums, int* scratch) {
+	typedef typename make_int_indices<Kernel::width*Kernel::height>::type all_taps;
+	typedef typename make_int_indices<Kernel::height>::type column_taps;
+	typedef typename make_int_indices<Kernel::width>::type row_taps;
+
+	int radius = Kernel::width/2;
+
+	if (Kernel::separable()) {
+		// The column pass runs along whole rows, which vectorizes
+		for (int x = 0; x < width; x++) scratch[x] = column_sum<Kernel>(rows, x, column_taps());
+		for (int x = radius; x < width - radius; x++) sums[x] = row_sum<Kernel>(scratch, x, row_taps());
+	}
+	else {
+		for (int x = radius; x < width - radius; x++) sums[x] = direct_sum<Kernel>(rows, x, all_taps());
+	}
+}
+
+// A kernel read at runtime, of any odd size and with real taps
+class conv_kernel {
+	public:
+		conv_kernel();
+		conv_kernel(int width, int height, const std::vector<double>& taps);
+
+		// Rows of taps, one row per line with the same number on each
+		// Taps can be fractions like 1/16, a line "scale <factor>" multiplies every tap and # starts a comment
+		// Throws image_error if the file can't be read or the kernel isn't a rectangle with odd sides
+		static conv_kernel load(const char* filename);
+
+		int width() const { return m_width; }
+		int height() const { return m_height; }
+		double tap(int i, int j) const { return m_taps[i*m_width + j]; }
+
+		// Taps that aren't zero
+		int nonzero() const;
+		// Split into a column and a row whose product is the kernel, false if it isn't separable
+		bool separate(std::vector<double>& column, std::vector<double>& row) const;
+
+	private:
+		int m_width;
+		int m_height;
+		std::vector<double> m_taps;
+};
+
+// How convolve evaluates a kernel
+enum conv_method {
+	// Every tap that isn't zero, for small kernels
+	CONV_DIRECT,
+	// A column and then a row pass, for kernels that are the product of the two
+	CONV_SEPARABLE,
+	// Multiplying spectra tile by tile, for large kernels where the cost per pixel of the others grows with the area
+	CONV_FFT
+};
+
+conv_method conv_method_for(const conv_kernel& kernel);
+
+// Convolve every channel of the image with the kernel, rounding and clamping the results to 0-255
+// Pixels the kernel would reach past the edges of the image from are left as they are
+void convolve(image_io& image_src, const conv_kernel& kernel);
+// Same with the method chosen rather than picked from the kernel, a kernel that isn't separable can't use CONV_SEPARABLE
+void convolve(image_io& image_src, const conv_kernel& kernel, conv_method method);
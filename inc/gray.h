@@ -0,0 +1,62 @@
+#pragma once
+
+#include "indices.h"
+
+#include <SDL/SDL.h>
+
+
+// Weights of the red, green and blue channels in the gray value, as fractions over a common scale
+template<int Red, int Green, int Blue, int Scale>
+struct gray_weights {
+	static const int red = Red;
+	static const int green = Green;
+	static const int blue = Blue;
+	static const int scale = Scale;
+};
+
+// The set is chosen when compiling, make GRAY=601 or GRAY=709
+#if defined(IMAGE_GRAY_BT601)
+typedef gray_weights<299, 587, 114, 1000> gray_coefficients;
+#elif defined(IMAGE_GRAY_BT709)
+typedef gray_weights<2126, 7152, 722, 10000> gray_coefficients;
+#else
+// The weights the gray value has always had, close to BT.601 but adding up to 1.001
+typedef gray_weights<300, 587, 114, 1000> gray_coefficients;
+#endif
+
+// Gray values are summed in fixed point with this many fractional bits
+#define GRAY_SHIFT 23
+
+// A weight in fixed point, rounded up
+// Each of the three channels then adds less than 255 units past the exact sum, and while the exact sum isn't an integer
+// it's at least 1/scale below the next one, so rounding the fixed point sum down gives the exact gray value
+constexpr Uint32 gray_fixed(int weight, int scale) {
+	return (((Uint64) weight << GRAY_SHIFT) + scale - 1)/scale;
+}
+
+static const Uint32 gray_red = gray_fixed(gray_coefficients::red, gray_coefficients::scale);
+static const Uint32 gray_green = gray_fixed(gray_coefficients::green, gray_coefficients::scale);
+static const Uint32 gray_blue = gray_fixed(gray_coefficients::blue, gray_coefficients::scale);
+
+static_assert(3*255*(Uint64) gray_coefficients::scale < (1 << GRAY_SHIFT), "Gray weights need more fractional bits to round down exactly");
+static_assert(255*((Uint64) gray_red + gray_green + gray_blue) <= 0xFFFFFFFF, "Gray sums have to fit in 32 bits");
+
+// The weight of a channel times each of its 256 values
+template<Uint32 Weight, class Indices = make_int_indices<256>::type>
+struct gray_table;
+
+template<Uint32 Weight, int... I>
+struct gray_table<Weight, int_indices<I...>> {
+	static constexpr Uint32 values[256] = {Weight*I...};
+};
+
+template<Uint32 Weight, int... I>
+constexpr Uint32 gray_table<Weight, int_indices<I...>>::values[256];
+
+// Convert an RGB pixel representation to a grayscale value
+// Three lookups and two adds, the result is the exact weighted sum rounded down
+inline Uint8 RGB_to_gray(Uint32 RGB_pixel) {
+	return (gray_table<gray_red>::values[(RGB_pixel >> 0) & 0xFF]
+			+ gray_table<gray_green>::values[(RGB_pixel >> 8) & 0xFF]
+			+ gray_table<gray_blue>::values[(RGB_pixel >> 16) & 0xFF]) >> GRAY_SHIFT;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "image_io.h"
+
+#include <array>
+
+
+// Forward declaration
+class point_ops;
+
+// Channels counted by a histogram
+enum histogram_channel {
+	H_RED,
+	H_GREEN,
+	H_BLUE,
+	H_GRAY
+};
+
+// Counts of every level of the red, green and blue channels and of the gray value
+// Measured once, then shared by whatever needs the distribution of the image
+class histogram {
+	public:
+		// Empty
+		histogram();
+		// Count the pixels of the image
+		explicit histogram(image_io& image_src);
+		// Count the pixels of the image as the operations queued in ops would leave them
+		histogram(image_io& image_src, const point_ops& ops);
+		// Count the pixels of a rectangle of the image
+		// Takes no lock, the caller holds it so several rectangles can be counted in parallel
+		histogram(image_io& image_src, int x, int y, int width, int height);
+
+		// Add the counts of another histogram
+		void merge(const histogram& other);
+
+		Uint64 count(histogram_channel channel, int level) const { return m_bins[channel][level]; }
+		// Pixels counted
+		Uint64 total() const;
+
+		// Transfer function of each color channel spreading its levels evenly over the whole range
+		// A clip limit above 0 first caps every level at that many times the mean count, which limits the contrast gained
+		std::array<std::array<Uint8, 256>, 3> equalization(double clip_limit = 0) const;
+		// Threshold splitting the gray levels into the two classes with the most variance between them (Otsu's method)
+		// Pixels at or above it are the brighter class
+		Uint32 otsu_threshold() const;
+
+	private:
+		// Add the pixels of a rectangle of the image, mapped through ops
+		void add_pixels(image_io& image_src, const point_ops& ops, int x_begin, int y_begin, int width, int height);
+
+		std::array<std::array<Uint64, 256>, 4> m_bins;
+};
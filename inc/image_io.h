@@ -3,23 +3,92 @@
 #include <SDL/SDL.h>
 
 #include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 
+// Thrown when an image can't be created, read or written
+class image_error : public std::runtime_error {
+	public:
+		image_error(const std::string& message) : std::runtime_error(message) {}
+};
+
+// SDL 1.2 keeps the pitch of a surface in 16 bits, so rows of 32-bit pixels can't be any wider than this
+// SDL_CreateRGBSurface refuses wider surfaces, but SDL_CreateRGBSurfaceFrom takes them and the pitch wraps around
+#define IMAGE_MAX_WIDTH 16383
+
+// Forward declaration
+class mapped_file;
+
 // Class to open an instance of an image
+// Every image is normalized to a tightly packed 32-bit row-major buffer
+// Pixels are stored as red << 0 | green << 8 | blue << 16, the same layout pack_RGB produces
+// Uncompressed BMP, PPM and PGM files are mapped and read in place, other formats go through SDL_image
+// Failures throw image_error
 class image_io {
 	public:
 		// Create an image object
 		image_io(const char* filename);
+		// Same, but keep the pixels in output_file, created as a BMP of the right size and mapped
+		// The transforms then write straight into the file and write(output_file) has nothing left to do
+		// Output files that aren't BMPs, or are the input itself, are written by write() as usual
+		image_io(const char* filename, const char* output_file);
+		// Create a blank (black) image
+		image_io(int width, int height);
+		// Take ownership of an existing surface and normalize it
+		image_io(SDL_Surface* image);
+		// View of the rows [y, y + height) of another image, sharing its pixels
+		// The other image has to outlive the view
+		image_io(image_io& image, int y, int height);
 		image_io(const image_io& image_old);
 		~image_io();
 
 		SDL_Surface* get_image();
 
+		// Written as raw_format_for picks from the name, through a mapping of the file sized for it up front
 		void write(const char* filename);
 
 		Uint32 get_pixel(int x, int y);
 		void put_pixel(int x, int y, Uint32 pixel);
 
+		int width() const { return m_image->w; }
+		int height() const { return m_image->h; }
+
+		// Row pointer accessors
+		// Rows are width() pixels long and are laid out back to back
+		Uint32* row(int y) { return (Uint32*) ((Uint8*) m_image->pixels + y*m_image->pitch); }
+		const Uint32* row(int y) const { return (const Uint32*) ((const Uint8*) m_image->pixels + y*m_image->pitch); }
+
+		Uint32* pixels() { return row(0); }
+
+		// Gray value of every pixel, RGB_to_gray of it, as rows of width() bytes
+		// Built in one pass the first time it's asked for and kept until invalidate_gray
+		// Call it before handing the image to several threads, it isn't safe to build from more than one
+		// A view has a plane of its own, whoever changes pixels through a view invalidates the image it views too
+		const Uint8* gray();
+		const Uint8* gray_row(int y) { return gray() + (size_t) y*width(); }
+
+		// Anything that changes the pixels calls this once it's done, the gray plane is rebuilt when next asked for
+		void invalidate_gray() { m_gray_valid = false; }
+
 	private:
+		void open(const char* filename, const char* output_file);
+		// Create the surface over the pixels of a new BMP
+		void create_mapped(const char* output_file, int width, int height);
+		// Move the pixels out of m_file into memory of their own
+		void detach();
+
+		// Convert m_image to the packed 32-bit format
+		void normalize();
+
 		SDL_Surface* m_image;
+
+		// File the pixels live in, if any, and whether it's the output or the input
+		std::unique_ptr<mapped_file> m_file;
+		std::string m_file_name;
+		bool m_file_output;
+
+		std::vector<Uint8> m_gray;
+		bool m_gray_valid;
 };
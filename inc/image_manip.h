@@ -1,5 +1,80 @@
 #pragma once
 
+#include "binary_image.h"
+
+#include "convolution.h"
+
 #include "image_io.h"
 
 #include "transforms.h"
+
+#include "point_ops.h"
+
+#include "thread_pool.h"
+
+#include <ostream>
+
+
+// Operations asked for on the command line
+// A batch applies the same ones to every image
+struct manip_options {
+	// Threshold flags
+	int t_flag = 0;
+	int t_value = 0;
+	int t_otsu_flag = 0;
+
+	// Dilation flags
+	int d_flag = 0;
+	int d_value = 0;
+
+	// Erosion flags
+	int r_flag = 0;
+	int r_value = 0;
+
+	// Sobel gradient flags
+	int g_flag = 0;
+	sobel_output g_output = SOBEL_L2;
+
+	// Laplace flag
+	int l_flag = 0;
+
+	// Perimiter flag
+	int p_flag = 0;
+
+	// Area flag
+	int a_flag = 0;
+
+	// Moment flag
+	int m_flag = 0;
+
+	// Invariant flag
+	int v_flag = 0;
+
+	// Eigen flag
+	int e_flag = 0;
+
+	// Invert flag
+	int i_flag = 0;
+
+	// Smooth method
+	int s_med_flag = 0;
+	int s_mean_flag = 0;
+	int s_mean_radius = 1;
+	int s_med_radius = 1;
+
+	// Kernel convolution flag
+	int k_flag = 0;
+	conv_kernel k_kernel;
+
+	// Histogram equalization flag
+	int h_flag = 0;
+	int h_adaptive_flag = 0;
+	int h_tiles = 8;
+	double h_clip = 2;
+
+	// Color mask flags
+	int c_flag = 0;
+	int c_r_flag = 0;
+	int c_g_flag = 0;
+	int c_b_flag = 0;
+};
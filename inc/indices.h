@@ -0,0 +1,7 @@
+#pragma once
+
+
+// Index sequences for expanding over 0 to N - 1 at compile time
+template<int... I> struct int_indices {};
+template<int N, int... I> struct make_int_indices : make_int_indices<N - 1, N - 1, I...> {};
+template<int... I> struct make_int_indices<0, I...> { typedef int_indices<I...> type; };
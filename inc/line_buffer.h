@@ -0,0 +1,33 @@
+#pragma once
+
+#include <SDL/SDL.h>
+
+#include <cstring>
+#include <vector>
+
+
+// Ring of copies of the most recent source rows
+// Lets a neighborhood transform write its output in place while it still needs the original rows above it
+class line_buffer {
+	public:
+		line_buffer(int width, int rows) : m_width(width), m_rows(rows), m_data((size_t) width*rows) {}
+
+		// Store a copy of source row y, replacing row y - rows
+		void push(int y, const Uint32* row) {
+			memcpy(slot(y), row, m_width*sizeof(Uint32));
+		}
+
+		// Source row y, must be one of the last rows pushed
+		const Uint32* row(int y) const {
+			return &m_data[(size_t) (y % m_rows)*m_width];
+		}
+
+	private:
+		Uint32* slot(int y) {
+			return &m_data[(size_t) (y % m_rows)*m_width];
+		}
+
+		int m_width;
+		int m_rows;
+		std::vector<Uint32> m_data;
+};
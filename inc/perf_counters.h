@@ -0,0 +1,47 @@
+#pragma once
+
+#include <SDL/SDL.h>
+
+#include <string>
+#include <vector>
+
+
+// Hardware events counted around each profiled stage
+enum perf_event {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_EVENTS
+};
+
+// Linux perf_event counters of every thread of the process
+// Threads running when start is called are counted, later ones once they call add_thread
+// Counts are for the whole process, like the CPU time of the profile, so work on the thread pool is included
+class perf_counters {
+	public:
+		perf_counters();
+		~perf_counters();
+
+		// Open the counters, false with the reason in error() if the kernel or the hardware won't provide them
+		bool start();
+		bool running() const { return m_running; }
+		const std::string& error() const { return m_error; }
+
+		// Count the calling thread too, if it isn't already
+		void add_thread();
+
+		// Totals so far, scaled up for the time the kernel had to share the hardware counters with other events
+		void read(Uint64 counts[PERF_EVENTS]);
+
+	private:
+		// Group of counters of one thread, the cycles counter leads the rest
+		bool open_thread(int tid);
+
+		bool m_running;
+		std::string m_error;
+
+		std::vector<int> m_leaders;
+		std::vector<int> m_fds;
+		std::vector<int> m_threads;
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <SDL/SDL.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+// Bounded queue for any number of producers and consumers, without locks
+// Every cell carries a sequence number saying whose turn it is, a producer or consumer claims a cell by moving
+// the tail or head past it and hands it over by bumping the sequence (Dmitry Vyukov's design)
+template <typename T>
+class bounded_queue {
+	public:
+		// The capacity is rounded up to a power of two
+		explicit bounded_queue(size_t capacity) {
+			size_t size = 1;
+
+			while (size < capacity) size *= 2;
+
+			m_cells.reset(new cell[size]);
+			m_mask = size - 1;
+
+			for (size_t i = 0; i < size; i++) m_cells[i].sequence.store(i, std::memory_order_relaxed);
+
+			m_head.store(0, std::memory_order_relaxed);
+			m_tail.store(0, std::memory_order_relaxed);
+		}
+
+		// False if the queue is full, value is then left as it is
+		bool try_push(T& value) {
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+
+			for (;;) {
+				cell& target = m_cells[tail & m_mask];
+				size_t sequence = target.sequence.load(std::memory_order_acquire);
+				long difference = (long) sequence - (long) tail;
+
+				if (difference == 0) {
+					if (m_tail.compare_exchange_weak(tail, tail + 1, std::memory_order_relaxed)) {
+						target.value = std::move(value);
+						target.sequence.store(tail + 1, std::memory_order_release);
+
+						return true;
+					}
+				}
+				else if (difference < 0) {
+					return false;
+				}
+				else {
+					tail = m_tail.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		// False if the queue is empty
+		bool try_pop(T& value) {
+			size_t head = m_head.load(std::memory_order_relaxed);
+
+			for (;;) {
+				cell& source = m_cells[head & m_mask];
+				size_t sequence = source.sequence.load(std::memory_order_acquire);
+				long difference = (long) sequence - (long) (head + 1);
+
+				if (difference == 0) {
+					if (m_head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+						value = std::move(source.value);
+						source.sequence.store(head + m_mask + 1, std::memory_order_release);
+
+						return true;
+					}
+				}
+				else if (difference < 0) {
+					return false;
+				}
+				else {
+					head = m_head.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		size_t capacity() const { return m_mask + 1; }
+
+		// Items waiting, only approximate while other threads push and pop
+		size_t size() const {
+			size_t head = m_head.load(std::memory_order_relaxed);
+			size_t tail = m_tail.load(std::memory_order_relaxed);
+
+			return (tail > head) ? tail - head : 0;
+		}
+
+	private:
+		struct cell {
+			std::atomic<size_t> sequence;
+			T value;
+		};
+
+		std::unique_ptr<cell[]> m_cells;
+		size_t m_mask;
+
+		// Kept on separate cache lines so producers and consumers don't fight over them
+		alignas(64) std::atomic<size_t> m_head;
+		alignas(64) std::atomic<size_t> m_tail;
+};
+
+// Counters of one stage of a pipeline, the times are in nanoseconds summed over its threads
+struct stage_counters {
+	stage_counters() : threads(0), items(0), busy(0), blocked(0) {}
+
+	int threads;
+	std::atomic<Uint64> items;
+	// Inside the stage function
+	std::atomic<Uint64> busy;
+	// Waiting on an empty queue before it or a full queue after it
+	std::atomic<Uint64> blocked;
+};
+
+// Depth of a queue, sampled every time an item is pushed
+struct queue_counters {
+	queue_counters() : capacity(0), pushes(0), depth_sum(0), depth_max(0) {}
+
+	size_t capacity;
+	std::atomic<Uint64> pushes;
+	std::atomic<Uint64> depth_sum;
+	std::atomic<Uint64> depth_max;
+};
+
+struct pipeline_counters {
+	pipeline_counters() : wall(0) {}
+
+	// Source, transform and sink
+	stage_counters stages[3];
+	// Between the source and the transform, and between the transform and the sink
+	queue_counters queues[2];
+	// Nanoseconds from start to finish
+	Uint64 wall;
+};
+
+// Run count items through three stages connected by bounded queues
+// source(i, item) produces item i, transform(item) works on it and sink(item) consumes it, the first two return
+// false to drop an item
+// Every stage has threads[stage] threads of its own, so a stage waiting on the disk doesn't hold up the others,
+// and a full queue holds back the stage before it so only a bounded number of items are in flight
+// parallel_for calls from the stage threads run serially, the stages are the parallelism
+template <typename T>
+void run_pipeline(int count, const int threads[3], size_t queue_capacity,
+					const std::function<bool(int, T&)>& source,
+					const std::function<bool(T&)>& transform,
+					const std::function<void(T&)>& sink,
+					pipeline_counters& counters) {
+	typedef std::chrono::steady_clock clock;
+
+	auto nanoseconds = [](clock::time_point begin) {
+		return (Uint64) std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - begin).count();
+	};
+
+	bounded_queue<T> queue_source(queue_capacity);
+	bounded_queue<T> queue_transform(queue_capacity);
+	bounded_queue<T>* queues[2] = {&queue_source, &queue_transform};
+
+	// Threads of each stage still running, a stage is finished once they're all gone
+	std::atomic<int> running[3];
+	std::atomic<int> next(0);
+
+	for (int s = 0; s < 3; s++) {
+		running[s].store(std::max(threads[s], 1));
+		counters.stages[s].threads = std::max(threads[s], 1);
+	}
+
+	for (int q = 0; q < 2; q++) counters.queues[q].capacity = queues[q]->capacity();
+
+	// Back off from a full or empty queue, spinning briefly before giving up the core
+	auto wait = [](int& attempts) {
+		if (++attempts < 64) std::this_thread::yield();
+		else std::this_thread::sleep_for(std::chrono::microseconds(50));
+	};
+
+	auto push = [&](int q, T& item, stage_counters& stage) {
+		clock::time_point begin = clock::now();
+
+		for (int attempts = 0; !queues[q]->try_push(item);) wait(attempts);
+
+		stage.blocked += nanoseconds(begin);
+
+		Uint64 depth = queues[q]->size();
+		Uint64 depth_max = counters.queues[q].depth_max.load();
+
+		counters.queues[q].pushes++;
+		counters.queues[q].depth_sum += depth;
+
+		while (depth > depth_max && !counters.queues[q].depth_max.compare_exchange_weak(depth_max, depth)) {}
+	};
+
+	// False once the stage before has finished and the queue is drained
+	auto pop = [&](int q, T& item, stage_counters& stage) {
+		clock::time_point begin = clock::now();
+		bool popped = false;
+
+		for (int attempts = 0; !(popped = queues[q]->try_pop(item));) {
+			// Check again after seeing the stage finish, it may have pushed its last items in the meantime
+			if (running[q].load() == 0) {
+				popped = queues[q]->try_pop(item);
+
+				break;
+			}
+
+			wait(attempts);
+		}
+
+		stage.blocked += nanoseconds(begin);
+
+		return popped;
+	};
+
+	auto run_source = [&]() {
+		set_serial(true);
+
+		stage_counters& stage = counters.stages[0];
+
+		for (int i; (i = next++) < count;) {
+			T item;
+
+			clock::time_point begin = clock::now();
+			bool keep = source(i, item);
+			stage.busy += nanoseconds(begin);
+			stage.items++;
+
+			if (keep) push(0, item, stage);
+		}
+
+		running[0]--;
+	};
+
+	auto run_transform = [&]() {
+		set_serial(true);
+
+		stage_counters& stage = counters.stages[1];
+
+		for (T item; pop(0, item, stage);) {
+			clock::time_point begin = clock::now();
+			bool keep = transform(item);
+			stage.busy += nanoseconds(begin);
+			stage.items++;
+
+			if (keep) push(1, item, stage);
+		}
+
+		running[1]--;
+	};
+
+	auto run_sink = [&]() {
+		set_serial(true);
+
+		stage_counters& stage = counters.stages[2];
+
+		for (T item; pop(1, item, stage);) {
+			clock::time_point begin = clock::now();
+			sink(item);
+			stage.busy += nanoseconds(begin);
+			stage.items++;
+		}
+
+		running[2]--;
+	};
+
+	clock::time_point begin = clock::now();
+
+	std::vector<std::thread> workers;
+
+	for (int i = 0; i < counters.stages[0].threads; i++) workers.push_back(std::thread(run_source));
+	for (int i = 0; i < counters.stages[1].threads; i++) workers.push_back(std::thread(run_transform));
+	for (int i = 0; i < counters.stages[2].threads; i++) workers.push_back(std::thread(run_sink));
+
+	for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+	counters.wall = nanoseconds(begin);
+}
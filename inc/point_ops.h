@@ -0,0 +1,63 @@
+#pragma once
+
+#include "binary_image.h"
+#include "image_io.h"
+
+#include <array>
+
+
+// Compiles a run of point operations (color mask, invert, threshold, histogram equalization) into lookup tables
+// All pending operations are applied together in a single pass over the image
+class point_ops {
+	public:
+		point_ops();
+
+		// Queue up a point operation
+		void add_color_mask(int c_mask);
+		void add_invert();
+		void add_threshold(Uint32 threshold);
+		// Apply a transfer function to each channel
+		void add_lut(const std::array<std::array<Uint8, 256>, 3>& lut);
+		// Equalize the histogram of the image as it will look once the queued operations are applied
+		// Costs one read pass over the image
+		void add_hist_eq(image_io& image_src);
+		// Threshold at the gray level picked by Otsu's method from the image as it will look
+		// Costs one read pass over the image
+		void add_otsu_threshold(image_io& image_src);
+
+		bool empty() const { return m_empty; }
+
+		// Compute the result of the queued operations for a single pixel
+		Uint32 map(Uint32 pixel) const;
+
+		// Apply every queued operation in one pass and reset
+		void apply(image_io& image_src);
+		// Same, but store which pixels of the result are black in binary_dst and leave the image as it is
+		// Meant for operations ending in a threshold, where it's the only information left
+		void apply(image_io& image_src, binary_image& binary_dst);
+		void clear();
+
+	private:
+		// Apply a transfer function to the channels, or to the gray value once the channels are mixed
+		void compose_channels(const std::array<std::array<Uint8, 256>, 3>& lut);
+		// Apply a function of the gray value to all three channels
+		void compose_gray(const std::array<Uint8, 256>& lut);
+
+		// Channel tables in the form simd_lut_row takes, and the gray tables as whole pixels
+		void pack_tables(std::array<Uint32, 3*256>& pre_packed, std::array<Uint32, 256>& post_packed) const;
+
+		// Express the channel tables as bit operations if possible
+		bool bitwise_form(Uint32& and_mask, Uint32& xor_mask) const;
+		// Recognize the gray tables of a plain gray conversion or a threshold
+		bool copy_form() const;
+		bool threshold_form(Uint32& threshold) const;
+
+		// Tables applied to each channel of the source pixel
+		std::array<std::array<Uint8, 256>, 3> m_pre;
+		// Set once an operation has mixed the channels into a gray value
+		bool m_gray;
+		// Tables indexed by the gray value producing each output channel
+		std::array<std::array<Uint8, 256>, 3> m_post;
+
+		bool m_empty;
+};
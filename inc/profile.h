@@ -0,0 +1,66 @@
+#pragma once
+
+#include "perf_counters.h"
+
+#include <SDL/SDL.h>
+
+#include <ostream>
+#include <string>
+
+
+// Per-stage profiling of a run
+// Compiled in with -DIMAGE_PROFILE (PROFILE=1 to make, the default), without it the macros expand to nothing
+// Each scope records wall and CPU time, bytes allocated and pixels processed, and optionally hardware counters
+// Scopes nest, and repeated scopes at the same place (one per strip when streaming) are summed together
+
+#ifdef IMAGE_PROFILE
+
+// Start recording, scopes entered before this aren't recorded
+void profile_start();
+bool profile_enabled();
+// Also count cycles, instructions, cache misses and branch misses of each stage
+// False with the reason in error if the counters can't be opened, the profile then goes on without them
+bool profile_start_counters(std::string& error);
+
+// Count memory allocated outside of operator new, like the pixels of SDL surfaces
+void profile_alloc(Uint64 bytes);
+// Count pixels processed by the innermost scope of the calling thread, for when they aren't known up front
+void profile_pixels(Uint64 pixels);
+
+// Table of the stages in the order they first ran
+void profile_report(std::ostream& out);
+// Same, as JSON, false if the file can't be written
+bool profile_write_json(const char* filename);
+
+// Records the time from construction to destruction as a stage called name
+// CPU time is that of the whole process, so work handed to the thread pool counts
+class profile_scope {
+	public:
+		profile_scope(const char* name, Uint64 pixels);
+		~profile_scope();
+
+	private:
+		// Index of the stage being recorded, -1 while profiling is off
+		int m_stage;
+		int m_parent;
+
+		double m_wall;
+		double m_cpu;
+		Uint64 m_bytes;
+		Uint64 m_events[PERF_EVENTS];
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#define PROFILE_SCOPE(name, pixels) profile_scope PROFILE_CONCAT(profile_scope_, __LINE__)(name, pixels)
+#define PROFILE_ALLOC(bytes) profile_alloc(bytes)
+#define PROFILE_PIXELS(pixels) profile_pixels(pixels)
+
+#else
+
+#define PROFILE_SCOPE(name, pixels) ((void) 0)
+#define PROFILE_ALLOC(bytes) ((void) 0)
+#define PROFILE_PIXELS(pixels) ((void) 0)
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+#include "image_io.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+// A whole file mapped into memory
+class mapped_file {
+	public:
+		// Map an existing file for reading, writes to the memory stay private to the process
+		explicit mapped_file(const char* filename);
+		// Create a file of size bytes, or cut an existing one to that size, and map it
+		// Writes to the memory go to the file
+		mapped_file(const char* filename, size_t size);
+		~mapped_file();
+
+		Uint8* data() { return m_data; }
+		size_t size() const { return m_size; }
+
+	private:
+		void map(int fd, int flags);
+
+		Uint8* m_data;
+		size_t m_size;
+};
+
+// Whether two names are the same file, false if either doesn't exist
+bool same_file(const char* name_a, const char* name_b);
+
+// Kinds of uncompressed file the pixels can be stored in
+enum raw_format {
+	RAW_BMP,
+	RAW_PPM,
+	RAW_PGM
+};
+
+// Format to write filename as, from its extension
+// .ppm and .pgm are written as binary PPM and PGM, anything else as a BMP
+raw_format raw_format_for(const char* filename);
+
+// Where the pixels of an uncompressed BMP, PPM or PGM file are and how they're stored
+// Reads BMP (8-bit paletted, 24 and 32-bit), binary PPM (P6) and binary PGM (P5) with 8-bit samples
+// Writes BMPs as 32-bit top down images with the channel masks of image_io, so their pixels can be used where they are
+class raw_layout {
+	public:
+		// Nothing yet, see parse
+		raw_layout();
+		// Layout to write an image of this size in
+		raw_layout(raw_format format, int width, int height);
+
+		// Read the header at the start of a file of size bytes
+		// False if it isn't one of these formats or is a variant of them that can't be read here, like a 16-bit or RLE BMP
+		// Throws image_error if the header or the data is malformed or truncated
+		bool parse(const Uint8* file, size_t size);
+
+		int width() const { return m_width; }
+		int height() const { return m_height; }
+
+		// Bytes the whole file takes
+		size_t size() const { return m_data + (size_t) m_stride*m_height; }
+
+		// Whether the rows are stored top down in the packed 32-bit format of image_io
+		// Such a file can be wrapped as an image as it is
+		bool packed() const { return m_packed; }
+
+		const Uint8* row(const Uint8* file, int y) const;
+		Uint8* row(Uint8* file, int y) const;
+
+		// Convert row y of the file to the packed 32-bit format
+		void read_row(const Uint8* file, int y, Uint32* dst) const;
+
+		void write_header(Uint8* file) const;
+		// Store a row of packed 32-bit pixels as row y of the file
+		void write_row(Uint8* file, int y, const Uint32* src) const;
+
+	private:
+		bool parse_bmp(const Uint8* file, size_t size);
+		bool parse_pnm(const Uint8* file, size_t size);
+
+		raw_format m_format;
+		int m_width;
+		int m_height;
+
+		// Bytes per pixel in the file, 1 is paletted for BMP and gray for PGM
+		int m_bytes;
+		bool m_bottom_up;
+		// 32-bit BMP pixels stored red first rather than blue first
+		bool m_red_first;
+		bool m_packed;
+
+		// Where the pixels start and how far apart the rows are, BMP rows are padded to 4 bytes
+		size_t m_data;
+		size_t m_stride;
+
+		std::vector<Uint32> m_palette;
+};
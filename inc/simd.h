@@ -0,0 +1,48 @@
+#pragma once
+
+#include <SDL/SDL.h>
+
+
+// Instruction sets the row kernels are implemented for
+enum simd_level {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
+
+// Best instruction set this CPU supports, read from cpuid
+simd_level simd_detect();
+// Instruction set currently used by the row kernels, defaults to simd_detect()
+simd_level simd_get();
+// Force a specific instruction set, capped at what the CPU supports
+void simd_set(simd_level level);
+const char* simd_name(simd_level level);
+
+// Row kernels
+// Each one works on n packed pixels and gives bit-exact results with the scalar reference on every path
+
+// Gray value of each pixel, see RGB_to_gray
+void simd_gray_row(const Uint32* src, Uint8* dst, int n);
+// pixel = (pixel & and_mask) ^ xor_mask
+// Covers color masking and inversion
+void simd_bitwise_row(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask);
+// Apply the bit operations, then replace every pixel with its gray value in all three channels
+void simd_gray_replicate_row(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask);
+// Apply the bit operations, then turn pixels white if their gray value is at least the threshold and black otherwise
+void simd_threshold_row(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask, Uint32 threshold);
+
+// Split packed pixels into red/green/blue planes and back
+void simd_unpack_row(const Uint32* src, Uint8* red, Uint8* green, Uint8* blue, int n);
+void simd_pack_row(const Uint8* red, const Uint8* green, const Uint8* blue, Uint32* dst, int n);
+
+// pixel = lut[red] | lut[256 + green] | lut[512 + blue]
+// Applies a table per channel, each entry holding its value already shifted into place
+void simd_lut_row(Uint32* row, int n, const Uint32* lut);
+
+// Per-channel median of the 3x3 neighborhood of pixels 1 to n - 2 of row, written to the same positions of dst
+// dst must not overlap the source rows
+void simd_median3_row(const Uint32* above, const Uint32* row, const Uint32* below, Uint32* dst, int n);
+
+// Set bit x % 64 of word x / 64 where gray[x] is below the threshold, the bits past n are cleared
+void simd_threshold_bits_row(const Uint8* gray, Uint64* bits, int n, Uint32 threshold);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "image_io.h"
+
+#include <functional>
+#include <vector>
+
+
+// One step of a chain of transforms run over an image a strip of rows at a time
+struct strip_stage {
+	strip_stage(int halo, const std::function<void(image_io&)>& transform,
+				const std::function<void(image_io&, int, int, int)>& measure = nullptr)
+		: halo(halo), transform(transform), measure(measure) {}
+
+	// Rows above and below an output row that its value depends on
+	int halo;
+	// Transforms a strip in place the same way it would the whole image, may be empty
+	std::function<void(image_io&)> transform;
+	// Sees the rows [begin, end) of each strip once they're final, row 0 of the strip being row y_first of the image
+	std::function<void(image_io& strip, int begin, int end, int y_first)> measure;
+};
+
+// Run the image in input_file through the stages in order, reading strip_rows rows at a time with strip_reader
+// Each stage holds its current strip and halo rows on either side of it, and passes rows on as soon as they're final
+// A stage without a halo works in place on the rows it's given, so memory is O(width*(strip_rows + total halo))
+// Every row comes out the same as if the stage had transformed the whole image, throws image_error
+void run_stream(const char* input_file, const std::vector<strip_stage>& stages, int strip_rows);
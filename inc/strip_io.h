@@ -0,0 +1,45 @@
+#pragma once
+
+#include "image_io.h"
+#include "raw_file.h"
+
+
+// Reads an uncompressed image a few rows at a time, top to bottom
+// Takes the formats raw_layout reads, rows come out in the packed 32-bit format of image_io
+// The file is mapped rather than loaded, only the pages of the rows being read are brought in
+// Rows are read into image_io strips, so images wider than IMAGE_MAX_WIDTH are refused when they're opened
+// Failures throw image_error
+class strip_reader {
+	public:
+		strip_reader(const char* filename);
+
+		int width() const { return m_layout.width(); }
+		int height() const { return m_layout.height(); }
+
+		// Read the next count rows into the first rows of strip
+		void read(image_io& strip, int count);
+
+	private:
+		mapped_file m_file;
+		raw_layout m_layout;
+
+		// Next row to read
+		int m_next;
+};
+
+// Writes an image a few rows at a time, top to bottom, in the format raw_format_for picks from the file name
+// The file is laid out in full and mapped up front, each row is stored straight into it
+class strip_writer {
+	public:
+		strip_writer(const char* filename, int width, int height);
+
+		// Write the rows [begin, end) of strip as the next rows of the image
+		void write(image_io& strip, int begin, int end);
+
+	private:
+		raw_layout m_layout;
+		mapped_file m_file;
+
+		// Next row to write
+		int m_next;
+};
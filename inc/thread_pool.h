@@ -0,0 +1,18 @@
+#pragma once
+
+#include <functional>
+
+
+// Number of threads the parallel transforms use, counting the calling thread
+// 1 runs everything on the calling thread, 0 uses every core
+void set_threads(int threads);
+int get_threads();
+
+// Run task(i) for every i in [0, count) on the worker threads and wait for all of them to finish
+// Tasks are handed out one at a time from a shared counter, so threads that finish early take more of them
+// Calls made from inside a task, or while another call is running, run serially on the calling thread
+void parallel_for(int count, const std::function<void(int)>& task);
+
+// Make parallel_for calls from the calling thread run serially on it
+// For threads that are already one of many doing the same kind of work
+void set_serial(bool serial);
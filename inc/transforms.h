@@ -1,5 +1,7 @@
 #pragma once
 
+#include "binary_image.h"
+#include "gray.h"
 #include "image_io.h"
 
 #include <array>
@@ -29,32 +31,84 @@ void color_mask(image_io& image_src, int mask);
 void invert(image_io& image_src);
 
 // Apply a smoothing effect
-// Utilizes a 3x3 neighborhood averaging algorithm
-void smooth_mean(image_io& image_src);
-// Utilizes a 3x3 neighborhood median algorithm
-void smooth_median(image_io& image_src);
+// Utilizes a (2*radius + 1) square neighborhood averaging algorithm, the cost per pixel doesn't depend on the radius
+void smooth_mean(image_io& image_src, int radius = 1);
+// Utilizes a (2*radius + 1) square neighborhood median algorithm, the cost per pixel doesn't depend on the radius
+void smooth_median(image_io& image_src, int radius = 1);
 
 // Adjust constrast with histogram equalization algorithm
 void hist_eq(image_io& image_src);
+// Contrast limited adaptive histogram equalization (CLAHE) over a grid of tiles by tiles
+// clip_limit caps each level of a tile's histogram at that many times its mean count, 0 doesn't clip
+void hist_eq_adaptive(image_io& image_src, int tiles = 8, double clip_limit = 2);
 
 // Convert an image into a binary (black/white) image splitting at the threshold. All pixels equal to or greater than the threshold will be turned white, all pixels below will be black
 void threshold(image_io& image_src, Uint32 threshold);
+// Same, but only store which pixels turn black in binary_dst, the image is left as it is
+void threshold(image_io& image_src, Uint32 threshold, binary_image& binary_dst);
+
+// What sobel_gradient writes to each pixel, as a gray value
+enum sobel_output {
+	// Magnitude of the gradient, sqrt(gx^2 + gy^2) saturated at 255
+	SOBEL_L2,
+	// |gx| + |gy| saturated at 255, cheaper and a little stronger along diagonals
+	SOBEL_L1,
+	// Direction of the gradient in 256ths of a turn, 0 pointing right and 64 down
+	SOBEL_ORIENTATION
+};
 
 // Edge detection using the Sobel Gradient
-void sobel_gradient(image_io& image_src);
+void sobel_gradient(image_io& image_src, sobel_output output = SOBEL_L2);
 // Edge detection using Laplacian Transformt
 void laplacian(image_io& image_src);
 
 // Degrade the image by n pixels
+// All n pixels are done in one pass, the time doesn't depend on n
 void erosion(image_io& image_src, int erode_n);
 // Enlarge the iamge by n pixels
 void dilation(image_io& image_src, int dilate_n);
 
+// Exact sums for the moments, the third order ones of a large image don't fit in 64 bits
+typedef unsigned __int128 Uint128;
+
+// Everything the shape measurements need, gathered in a single pass over the image
+// Sums over parts of an image can be gathered separately and merged
+struct shape_stats {
+	shape_stats();
+
+	// Add the sums from another part of the image
+	void merge(const shape_stats& other);
+
+	// The moments in the form moment() returns them
+	std::array<std::array<double, 4>, 4> moments() const;
+
+	// Black pixels off the outer edges
+	Uint64 area;
+	// Pixels off the outer edges that a single erosion changes
+	Uint64 perimeter;
+	// Mij = ExEy x^i*y^j*(255 - gray(x, y)), over every pixel
+	Uint128 M[4][4];
+};
+
+// Area, perimeter and moments in one pass
+shape_stats shape_statistics(image_io& image_src);
+shape_stats shape_statistics(const binary_image& binary_src);
+// Sums over the rows [y_begin, y_end) of a strip whose row 0 is row y_offset of an image height rows tall
+// The strip has to hold the rows just above and below them that are in the image
+shape_stats shape_statistics(image_io& strip_src, int y_begin, int y_end, int y_offset, int height);
+
 // Compute the perimeter
 int perimiter(image_io& image_src);
 // Compute the area
 int area(image_io& image_src);
 
+// The same transforms on a black and white image, 64 pixels at a time
+// They give the same results as the versions above on an image holding only black and white pixels
+void erosion(binary_image& binary_src, int erode_n);
+void dilation(binary_image& binary_src, int dilate_n);
+int perimiter(const binary_image& binary_src);
+int area(const binary_image& binary_src);
+
 // Compute the moment
 // Returns a 4x4 matrix
 std::array<std::array<double, 4>, 4> moment(image_io& image_src);
@@ -75,8 +129,7 @@ std::array<double, 7> invariants(const std::array<std::array<double, 4>, 4>& u);
 // Returns 2x3 matrix
 std::array<std::array<double, 2>, 3> eigen(const std::array<std::array<double, 4>, 4>& M, const std::array<double, 2>& C);
 
-// Convert an RGB pixel representation to a grayscale value
-Uint8 RGB_to_gray(Uint32 RGB_pixel);
+// Split an RGB pixel representation into its color components, RGB_to_gray is in gray.h
 Uint8 RGB_to_red(Uint32 RGB_pixel);
 Uint8 RGB_to_green(Uint32 RGB_pixel);
 Uint8 RGB_to_blue(Uint32 RGB_pixel);
@@ -0,0 +1,638 @@
+#include "binary_image.h"
+#include "convolution.h"
+#include "histogram.h"
+#include "image_io.h"
+#include "point_ops.h"
+#include "raw_file.h"
+#include "simd.h"
+#include "strip_io.h"
+#include "thread_pool.h"
+#include "transforms.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+// Fill an image with a deterministic pattern
+// Smooth gradients with some noise and a dark blob so the binary transforms have an object to work on
+static void fill_synthetic(image_io& image) {
+	Uint32 seed = 0x12345678;
+
+	for (int y = 0; y < image.height(); y++) {
+		Uint32* row = image.row(y);
+
+		for (int x = 0; x < image.width(); x++) {
+			// xorshift32
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+
+			int dx = x - image.width()/2;
+			int dy = y - image.height()/2;
+			bool inside = 4*(dx*dx + dy*dy) < image.width()*image.height()/2;
+
+			Uint8 red_value = inside ? (seed & 0x3F) : 128 + (x & 0x7F);
+			Uint8 green_value = inside ? ((seed >> 8) & 0x3F) : 128 + (y & 0x7F);
+			Uint8 blue_value = inside ? ((seed >> 16) & 0x3F) : 128 + ((seed >> 16) & 0x7F);
+
+			row[x] = pack_RGB(red_value, green_value, blue_value);
+		}
+	}
+}
+
+// Binomial blur of side taps, separable
+static conv_kernel binomial_kernel(int side) {
+	vector<double> line(1, 1);
+
+	for (int n = 1; n < side; n++) {
+		vector<double> next(n + 1, 1);
+
+		for (int k = 1; k < n; k++) next[k] = line[k - 1] + line[k];
+
+		line = next;
+	}
+
+	double total = pow(2.0, 2*(side - 1));
+	vector<double> taps;
+
+	for (int i = 0; i < side; i++) {
+		for (int j = 0; j < side; j++) taps.push_back(line[i]*line[j]/total);
+	}
+
+	return conv_kernel(side, side, taps);
+}
+
+// A kernel of side taps that isn't separable, every tap differs and they add up to 1
+static conv_kernel dense_kernel(int side) {
+	vector<double> taps;
+	double total = 0;
+
+	for (int i = 0; i < side; i++) {
+		for (int j = 0; j < side; j++) {
+			taps.push_back(1 + (i*7 + j*13) % 5);
+			total += taps.back();
+		}
+	}
+
+	for (double& value : taps) value /= total;
+
+	return conv_kernel(side, side, taps);
+}
+
+// Check the gray conversion against the exact weighted sums, and every vector path against the scalar reference
+// The gray conversion is checked for all 2^24 colors
+static bool verify_simd() {
+	const int n = 1 << 24;
+	bool pass = true;
+
+	vector<Uint32> pixels(n);
+	for (int i = 0; i < n; i++) pixels[i] = i;
+
+	simd_level detected = simd_detect();
+
+	// Reference results
+	simd_set(SIMD_SCALAR);
+
+	vector<Uint8> gray_ref(n);
+	simd_gray_row(pixels.data(), gray_ref.data(), n);
+
+	// The fixed point gray value against the exact weighted sum, and against the sum in double precision it replaced
+	// Where the exact sum is a whole number the double one can fall just short of it and round down one too far
+	int exact_mismatches = 0;
+	int double_mismatches = 0;
+	int double_short = 0;
+
+	for (int i = 0; i < n; i++) {
+		int red = RGB_to_red(i);
+		int green = RGB_to_green(i);
+		int blue = RGB_to_blue(i);
+
+		int sum = gray_coefficients::red*red + gray_coefficients::green*green + gray_coefficients::blue*blue;
+		Uint8 gray_double = (double) gray_coefficients::red/gray_coefficients::scale*red
+							+ (double) gray_coefficients::green/gray_coefficients::scale*green
+							+ (double) gray_coefficients::blue/gray_coefficients::scale*blue;
+
+		if (gray_ref[i] != sum/gray_coefficients::scale) exact_mismatches++;
+
+		if (gray_ref[i] == gray_double + 1 && sum % gray_coefficients::scale == 0) double_short++;
+		else if (gray_ref[i] != gray_double) double_mismatches++;
+	}
+
+	cout << "verify gray: " << ((exact_mismatches || double_mismatches) ? "FAIL" : "ok")
+		<< ", " << double_short << " colors a whole number the double precision sum fell short of" << endl;
+
+	if (exact_mismatches || double_mismatches) pass = false;
+
+	vector<Uint32> bitwise_ref(pixels), replicate_ref(pixels), threshold_ref(pixels);
+	simd_bitwise_row(bitwise_ref.data(), n, 0x00FF00FF, 0x00FFFFFF);
+	simd_gray_replicate_row(replicate_ref.data(), n, 0x0000FFFF, 0x000000FF);
+	simd_threshold_row(threshold_ref.data(), n, 0x00FFFFFF, 0x00FFFF00, 100);
+
+	vector<Uint8> planes_ref(3*n);
+	simd_unpack_row(pixels.data(), &planes_ref[0], &planes_ref[n], &planes_ref[2*n], n);
+
+	// Scrambled channel tables
+	vector<Uint32> lut(3*256);
+	for (int i = 0; i < 3*256; i++) lut[i] = ((i*167 + 13) & 0xFF) << 8*(i/256);
+
+	vector<Uint32> lut_ref(pixels);
+	simd_lut_row(lut_ref.data(), n, lut.data());
+
+	// Two more orderings of the colors as the rows around the median
+	vector<Uint32> above(n), below(n);
+	for (int i = 0; i < n; i++) {
+		above[i] = (i*2654435761u) & 0xFFFFFF;
+		below[i] = (i*40503u + 12345) & 0xFFFFFF;
+	}
+
+	vector<Uint32> median_ref(n, 0);
+	simd_median3_row(above.data(), pixels.data(), below.data(), median_ref.data(), n);
+
+	// Every threshold over the gray values
+	const Uint32 bits_thresholds[] = {0, 1, 100, 255, 256};
+	const int bits_words = (n + 63)/64;
+
+	vector<Uint64> bits_ref(5*bits_words);
+	for (int t = 0; t < 5; t++) simd_threshold_bits_row(gray_ref.data(), &bits_ref[t*bits_words], n, bits_thresholds[t]);
+
+	for (int level = SIMD_SSE2; level <= detected; level++) {
+		simd_set((simd_level) level);
+
+		// Odd lengths exercise the scalar tails
+		int m = n - level;
+
+		vector<Uint8> gray(n);
+		simd_gray_row(pixels.data(), gray.data(), m);
+
+		vector<Uint32> bitwise(pixels), replicate(pixels), threshold(pixels);
+		simd_bitwise_row(bitwise.data(), m, 0x00FF00FF, 0x00FFFFFF);
+		simd_gray_replicate_row(replicate.data(), m, 0x0000FFFF, 0x000000FF);
+		simd_threshold_row(threshold.data(), m, 0x00FFFFFF, 0x00FFFF00, 100);
+
+		vector<Uint8> planes(3*n);
+		simd_unpack_row(pixels.data(), &planes[0], &planes[n], &planes[2*n], m);
+
+		vector<Uint32> mapped(pixels);
+		simd_lut_row(mapped.data(), m, lut.data());
+
+		vector<Uint32> packed(n);
+		simd_pack_row(&planes_ref[0], &planes_ref[n], &planes_ref[2*n], packed.data(), m);
+
+		vector<Uint32> median(n, 0);
+		simd_median3_row(above.data(), pixels.data(), below.data(), median.data(), m);
+
+		vector<Uint64> bits(5*bits_words);
+		for (int t = 0; t < 5; t++) simd_threshold_bits_row(gray_ref.data(), &bits[t*bits_words], m, bits_thresholds[t]);
+
+		int mismatches = 0;
+
+		for (int i = 0; i < m; i++) {
+			if (gray[i] != gray_ref[i]) mismatches++;
+			if (bitwise[i] != bitwise_ref[i]) mismatches++;
+			if (replicate[i] != replicate_ref[i]) mismatches++;
+			if (threshold[i] != threshold_ref[i]) mismatches++;
+			if (planes[i] != planes_ref[i] || planes[n + i] != planes_ref[n + i] || planes[2*n + i] != planes_ref[2*n + i]) mismatches++;
+			if (packed[i] != pixels[i]) mismatches++;
+			if (mapped[i] != lut_ref[i]) mismatches++;
+			if (i < m - 1 && median[i] != median_ref[i]) mismatches++;
+
+			for (int t = 0; t < 5; t++) {
+				if (((bits[t*bits_words + i/64] ^ bits_ref[t*bits_words + i/64]) >> (i % 64)) & 1) mismatches++;
+			}
+		}
+
+		cout << "verify " << simd_name((simd_level) level) << ": " << (mismatches ? "FAIL" : "ok") << endl;
+
+		if (mismatches) pass = false;
+	}
+
+	simd_set(detected);
+
+	return pass;
+}
+
+// Write a width x 3 image in the format raw_format_for picks from filename, a pattern has_pattern recognizes
+static void write_pattern(const string& filename, int width) {
+	raw_layout layout(raw_format_for(filename.c_str()), width, 3);
+	mapped_file file(filename.c_str(), layout.size());
+	vector<Uint32> row(width);
+
+	layout.write_header(file.data());
+
+	for (int y = 0; y < 3; y++) {
+		for (int x = 0; x < width; x++) row[x] = pack_RGB(x & 0xFF, x >> 8, y);
+
+		layout.write_row(file.data(), y, row.data());
+	}
+}
+
+static bool has_pattern(image_io& image, int width) {
+	if (image.width() != width || image.height() != 3) return false;
+
+	for (int y = 0; y < 3; y++) {
+		for (int x = 0; x < width; x++) {
+			if (image.row(y)[x] != pack_RGB(x & 0xFF, x >> 8, y)) return false;
+		}
+	}
+
+	return true;
+}
+
+// Check that the widest images a surface can hold load with every row where it belongs, through a mapped output and
+// back in place from the packed BMP it leaves, and that anything wider is refused rather than having its rows overlap
+// The strip reader refuses them too, strips being images of the same width
+static bool verify_wide() {
+	char dir_name[] = "/tmp/bench_wide_XXXXXX";
+
+	if (!mkdtemp(dir_name)) {
+		cout << "verify wide images: FAIL, can't create a temporary directory" << endl;
+
+		return false;
+	}
+
+	string dir = dir_name;
+	string ppm = dir + "/image.ppm";
+	string bmp = dir + "/image.bmp";
+	string output = dir + "/output.bmp";
+
+	int failures = 0;
+
+	// True if loading throws image_error
+	auto refused = [](const function<void()>& load) {
+		try {
+			load();
+		}
+		catch (const image_error&) {
+			return true;
+		}
+
+		return false;
+	};
+
+	try {
+		write_pattern(ppm, IMAGE_MAX_WIDTH);
+
+		{
+			image_io image(ppm.c_str(), output.c_str());
+
+			if (!has_pattern(image, IMAGE_MAX_WIDTH)) failures++;
+		}
+
+		image_io image(output.c_str());
+
+		if (!has_pattern(image, IMAGE_MAX_WIDTH)) failures++;
+
+		unlink(output.c_str());
+
+		write_pattern(ppm, IMAGE_MAX_WIDTH + 1);
+		write_pattern(bmp, IMAGE_MAX_WIDTH + 1);
+
+		// Refused before the output is created
+		if (!refused([&]() { image_io image_wide(ppm.c_str(), output.c_str()); }) || access(output.c_str(), F_OK) == 0) failures++;
+		if (!refused([&]() { image_io image_wide(bmp.c_str()); })) failures++;
+		if (!refused([&]() { strip_reader reader(ppm.c_str()); })) failures++;
+	}
+	catch (const image_error& error) {
+		cout << error.what() << endl;
+		failures++;
+	}
+
+	unlink(ppm.c_str());
+	unlink(bmp.c_str());
+	unlink(output.c_str());
+	rmdir(dir_name);
+
+	cout << "verify wide images: " << (failures ? "FAIL" : "ok") << endl;
+
+	return failures == 0;
+}
+
+struct bench_case {
+	string name;
+	// Prepare the input (not timed)
+	function<void(image_io&)> prepare;
+	// The transform being measured
+	function<void(image_io&)> run;
+};
+
+// Channel masks of the source formats, by bytes per pixel
+// 1 is paletted, 2 is RGB565, 3 is the blue first order of 24-bit BMPs and 4 is the packed format of image_io
+static const Uint32 format_masks[5][3] = {
+	{0, 0, 0},
+	{0, 0, 0},
+	{0xF800, 0x07E0, 0x001F},
+	{0xFF0000, 0x00FF00, 0x0000FF},
+	{0x000000FF, 0x0000FF00, 0x00FF0000}
+};
+
+// Copy of the image in a surface of bytes bytes per pixel, as it would come from a file of that format
+static SDL_Surface* format_surface(image_io& image, int bytes) {
+	SDL_Surface* format = SDL_CreateRGBSurface(SDL_SWSURFACE, 1, 1, 8*bytes,
+							format_masks[bytes][0], format_masks[bytes][1], format_masks[bytes][2], 0);
+
+	if (!format) throw image_error(string("SDL_CreateRGBSurface: ") + SDL_GetError());
+
+	SDL_Surface* surface = SDL_ConvertSurface(image.get_image(), format->format, SDL_SWSURFACE);
+	SDL_FreeSurface(format);
+
+	if (!surface) throw image_error(string("SDL_ConvertSurface: ") + SDL_GetError());
+
+	return surface;
+}
+
+// Seconds each run took, the input is prepared again before every run
+static vector<double> time_runs(int iterations, const function<void()>& prepare, const function<void()>& run) {
+	vector<double> seconds;
+
+	for (int i = 0; i < iterations; i++) {
+		prepare();
+
+		auto start = chrono::steady_clock::now();
+		run();
+		auto stop = chrono::steady_clock::now();
+
+		seconds.push_back(chrono::duration<double>(stop - start).count());
+	}
+
+	sort(seconds.begin(), seconds.end());
+
+	return seconds;
+}
+
+// Nearest rank percentile of sorted times
+static double percentile(const vector<double>& seconds, double p) {
+	size_t rank = (size_t) ceil(p*seconds.size());
+
+	return seconds[min(max(rank, (size_t) 1), seconds.size()) - 1];
+}
+
+// Comma separated list of numbers, a size given as 1024 or 1024x768
+static bool parse_sizes(const string& list, vector<pair<int, int>>& sizes) {
+	stringstream items(list);
+	string item;
+
+	sizes.clear();
+
+	while (getline(items, item, ',')) {
+		size_t x = item.find('x');
+		int width = atoi(item.c_str());
+		int height = (x == string::npos) ? width : atoi(item.c_str() + x + 1);
+
+		if (width < 3 || height < 3) return false;
+
+		sizes.push_back(make_pair(width, height));
+	}
+
+	return !sizes.empty();
+}
+
+static bool parse_formats(const string& list, vector<int>& formats) {
+	stringstream items(list);
+	string item;
+
+	formats.clear();
+
+	while (getline(items, item, ',')) {
+		int bytes = atoi(item.c_str());
+
+		if (bytes < 1 || bytes > 4) return false;
+
+		formats.push_back(bytes);
+	}
+
+	return !formats.empty();
+}
+
+// Whether a case is picked by the comma separated substrings of --filter
+static bool matches(const string& name, const string& filter) {
+	if (filter.empty()) return true;
+
+	stringstream items(filter);
+	string item;
+
+	while (getline(items, item, ',')) {
+		if (!item.empty() && name.find(item) != string::npos) return true;
+	}
+
+	return false;
+}
+
+int main(int argc, char** argv) {
+	vector<int> numbers;
+
+	vector<pair<int, int>> sizes;
+	vector<int> formats = {4};
+	string filter;
+	bool csv = false;
+	bool usage = false;
+	int iterations = 5;
+
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+
+		if (arg == "--verify") {
+			bool pass = verify_simd();
+
+			return (verify_wide() && pass) ? 0 : 1;
+		}
+		else if (arg == "-j" && i + 1 < argc) {
+			set_threads(atoi(argv[++i]));
+		}
+		else if (arg == "--simd" && i + 1 < argc) {
+			string name = argv[++i];
+
+			for (int level = SIMD_SCALAR; level <= SIMD_AVX512; level++) {
+				if (name == simd_name((simd_level) level)) simd_set((simd_level) level);
+			}
+		}
+		else if (arg == "--sizes" && i + 1 < argc) {
+			if (!parse_sizes(argv[++i], sizes)) usage = true;
+		}
+		else if (arg == "--formats" && i + 1 < argc) {
+			if (!parse_formats(argv[++i], formats)) usage = true;
+		}
+		else if (arg == "--filter" && i + 1 < argc) {
+			filter = argv[++i];
+		}
+		else if (arg == "--iterations" && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		}
+		else if (arg == "--csv") {
+			csv = true;
+		}
+		else {
+			numbers.push_back(atoi(argv[i]));
+		}
+	}
+
+	// A single size can still be given as WIDTH HEIGHT
+	if (numbers.size() > 0) sizes.assign(1, make_pair(numbers[0], (numbers.size() > 1) ? numbers[1] : numbers[0]));
+	if (sizes.empty()) sizes = {{256, 256}, {1024, 1024}, {4096, 4096}};
+
+	if (numbers.size() > 2) iterations = numbers[2];
+
+	if (usage || sizes[0].first < 3 || sizes[0].second < 3 || iterations < 1) {
+		cout << "Usage: bench [--verify] [--simd scalar|sse2|avx2|avx512] [-j THREADS] [--sizes N|WxH,...] [--formats 1,2,3,4]\n"
+			<< "             [--iterations N] [--filter NAME,...] [--csv] [WIDTH [HEIGHT [ITERATIONS]]]\n";
+
+		return 1;
+	}
+
+	if (csv) {
+		cout << "case,width,height,bytes_per_pixel,simd,threads,iterations,median_ms,p95_ms,median_mps,p95_mps\n";
+	}
+	else {
+		cout << "Median and 95th percentile of " << iterations << " runs";
+		cout << ", " << simd_name(simd_get()) << ", " << get_threads() << " thread" << (get_threads() > 1 ? "s" : "") << endl;
+	}
+
+	// Separable, direct and FFT convolutions as conv_method_for picks them, and the largest one forced to direct
+	conv_kernel binomial_5 = binomial_kernel(5);
+	conv_kernel dense_7 = dense_kernel(7);
+	conv_kernel dense_25 = dense_kernel(25);
+
+	for (auto& size : sizes) {
+		int width = size.first;
+		int height = size.second;
+
+		for (int bytes : formats) {
+			// Inputs of other formats are normalized to 32 bits when they're loaded, so the transforms run on the
+			// same layout and only the load differs, besides the colors lost to the smaller formats
+			unique_ptr<image_io> image_src;
+
+			try {
+				image_io image_synthetic(width, height);
+				fill_synthetic(image_synthetic);
+
+				image_src.reset((bytes == 4) ? new image_io(image_synthetic) : new image_io(format_surface(image_synthetic, bytes)));
+			}
+			catch (const image_error& error) {
+				cerr << width << "x" << height << " at " << bytes << " bytes per pixel: " << error.what() << endl;
+
+				continue;
+			}
+
+			auto none = [](image_io&) {};
+			auto binarize = [](image_io& image) { threshold(image, 128); };
+
+			// The binary cases work on the same threshold at one bit per pixel
+			binary_image binary(width, height);
+			auto binarize_bits = [&](image_io& image) { threshold(image, 128, binary); };
+
+			vector<bench_case> cases = {
+				{"color_mask", none, [](image_io& image) { color_mask(image, M_RED); }},
+				{"color_mask_gray", none, [](image_io& image) { color_mask(image, M_RED | M_GREEN | M_BLUE); }},
+				{"invert", none, [](image_io& image) { invert(image); }},
+				{"smooth_mean", none, [](image_io& image) { smooth_mean(image); }},
+				{"smooth_mean_5", none, [](image_io& image) { smooth_mean(image, 5); }},
+				{"smooth_mean_25", none, [](image_io& image) { smooth_mean(image, 25); }},
+				{"smooth_median", none, [](image_io& image) { smooth_median(image); }},
+				{"smooth_median_5", none, [](image_io& image) { smooth_median(image, 5); }},
+				{"smooth_median_15", none, [](image_io& image) { smooth_median(image, 15); }},
+				{"hist_eq", none, [](image_io& image) { hist_eq(image); }},
+				{"hist_eq_adaptive_8", none, [](image_io& image) { hist_eq_adaptive(image, 8, 2); }},
+				{"hist_eq_adaptive_32", none, [](image_io& image) { hist_eq_adaptive(image, 32, 2); }},
+				{"histogram", none, [](image_io& image) { histogram counts(image); }},
+				{"threshold_otsu", none, [](image_io& image) {
+					point_ops ops;
+					ops.add_otsu_threshold(image);
+					ops.apply(image);
+				}},
+				{"threshold", none, [](image_io& image) { threshold(image, 128); }},
+				{"chain_separate", none, [](image_io& image) {
+					color_mask(image, M_GREEN | M_BLUE);
+					invert(image);
+					threshold(image, 128);
+				}},
+				{"chain_fused", none, [](image_io& image) {
+					point_ops ops;
+					ops.add_color_mask(M_GREEN | M_BLUE);
+					ops.add_invert();
+					ops.add_threshold(128);
+					ops.apply(image);
+				}},
+				{"sobel_gradient", none, [](image_io& image) { sobel_gradient(image); }},
+				{"sobel_gradient_l1", none, [](image_io& image) { sobel_gradient(image, SOBEL_L1); }},
+				{"sobel_gradient_orientation", none, [](image_io& image) { sobel_gradient(image, SOBEL_ORIENTATION); }},
+				{"laplacian", none, [](image_io& image) { laplacian(image); }},
+				{"convolve_binomial_5", none, [&](image_io& image) { convolve(image, binomial_5); }},
+				{"convolve_dense_7", none, [&](image_io& image) { convolve(image, dense_7); }},
+				{"convolve_dense_25", none, [&](image_io& image) { convolve(image, dense_25); }},
+				{"convolve_dense_25_direct", none, [&](image_io& image) { convolve(image, dense_25, CONV_DIRECT); }},
+				{"erosion_1", binarize, [](image_io& image) { erosion(image, 1); }},
+				{"dilation_1", binarize, [](image_io& image) { dilation(image, 1); }},
+				{"erosion_5", binarize, [](image_io& image) { erosion(image, 5); }},
+				{"dilation_5", binarize, [](image_io& image) { dilation(image, 5); }},
+				{"erosion_25", binarize, [](image_io& image) { erosion(image, 25); }},
+				{"dilation_25", binarize, [](image_io& image) { dilation(image, 25); }},
+				{"perimiter", binarize, [](image_io& image) { perimiter(image); }},
+				{"area", binarize, [](image_io& image) { area(image); }},
+				{"moment", binarize, [](image_io& image) { moment(image); }},
+				{"shape_statistics", binarize, [](image_io& image) { shape_statistics(image); }},
+				{"threshold_binary", none, [&](image_io& image) { threshold(image, 128, binary); }},
+				{"erosion_1_binary", binarize_bits, [&](image_io&) { erosion(binary, 1); }},
+				{"dilation_1_binary", binarize_bits, [&](image_io&) { dilation(binary, 1); }},
+				{"erosion_25_binary", binarize_bits, [&](image_io&) { erosion(binary, 25); }},
+				{"dilation_25_binary", binarize_bits, [&](image_io&) { dilation(binary, 25); }},
+				{"perimiter_binary", binarize_bits, [&](image_io&) { perimiter(binary); }},
+				{"area_binary", binarize_bits, [&](image_io&) { area(binary); }},
+				{"shape_statistics_binary", binarize_bits, [&](image_io&) { shape_statistics(binary); }},
+			};
+
+			// Loading is the conversion of a surface of the source format to the packed format
+			// A 32-bit surface is already packed and isn't converted at all, so there's nothing to time for it
+			SDL_Surface* surface = NULL;
+
+			if (bytes != 4) {
+				cases.insert(cases.begin(), {"load", [&](image_io& image) { surface = format_surface(image, bytes); },
+											[&](image_io&) { image_io loaded(surface); }});
+			}
+
+			double megapixels = (double) width*height/1e6;
+
+			if (!csv) cout << "\n" << width << "x" << height << ", " << bytes << " byte" << (bytes > 1 ? "s" : "") << " per pixel" << endl;
+
+			for (auto& c : cases) {
+				if (!matches(c.name, filter)) continue;
+
+				unique_ptr<image_io> image;
+
+				// Every run starts from a fresh copy of the input
+				vector<double> seconds = time_runs(iterations,
+					[&]() {
+						image.reset();
+						image.reset(new image_io(*image_src));
+						c.prepare(*image);
+					},
+					[&]() { c.run(*image); });
+
+				double median = percentile(seconds, 0.5);
+				double p95 = percentile(seconds, 0.95);
+
+				if (csv) {
+					cout << c.name << "," << width << "," << height << "," << bytes << "," << simd_name(simd_get()) << "," << get_threads()
+						<< "," << iterations << "," << median*1e3 << "," << p95*1e3 << "," << megapixels/median << "," << megapixels/p95 << endl;
+				}
+				else {
+					cout << left << setw(26) << c.name << right << fixed << setprecision(3)
+						<< setw(12) << median*1e3 << " ms" << setw(12) << p95*1e3 << " ms p95"
+						<< setprecision(1) << setw(10) << megapixels/median << " MP/s" << setw(10) << megapixels/p95 << " MP/s p95" << endl;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
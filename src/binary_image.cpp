@@ -0,0 +1,36 @@
+#include "binary_image.h"
+
+#include "simd.h"
+#include "transforms.h"
+
+
+using namespace std;
+
+binary_image::binary_image(int width, int height)
+	: m_width(width), m_height(height), m_words((width + 63)/64), m_bits((size_t) m_words*height, 0) {}
+
+binary_image::binary_image(image_io& image_src) : binary_image(image_src.width(), image_src.height()) {
+	locker lock(image_src);
+
+	// Only a gray value of 0 is black
+	for (int y = 0; y < m_height; y++) threshold_row(y, image_src.gray_row(y), 1);
+}
+
+void binary_image::threshold_row(int y, const Uint8* gray, Uint32 threshold) {
+	simd_threshold_bits_row(gray, row(y), m_width, threshold);
+}
+
+void binary_image::write(image_io& image_dst) const {
+	locker lock(image_dst);
+
+	for (int y = 0; y < m_height; y++) {
+		const Uint64* bits = row(y);
+		Uint32* row_dst = image_dst.row(y);
+
+		for (int x = 0; x < m_width; x++) {
+			row_dst[x] = ((bits[x >> 6] >> (x & 63)) & 1) ? 0x000000 : 0xFFFFFF;
+		}
+	}
+
+	image_dst.invalidate_gray();
+}
@@ -0,0 +1,444 @@
+#include "convolution.h"
+
+#include "bands.h"
+#include "profile.h"
+#include "simd.h"
+#include "transforms.h"
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+
+using namespace std;
+
+// Past this many taps a kernel that isn't separable is cheaper to apply through FFTs
+// The rows of sums vectorize well, so it takes about a 21x21 kernel before the transforms pay off
+#define CONV_FFT_TAPS 441
+
+conv_kernel::conv_kernel() : m_width(1), m_height(1), m_taps(1, 1) {}
+
+conv_kernel::conv_kernel(int width, int height, const vector<double>& taps) : m_width(width), m_height(height), m_taps(taps) {
+	if (width < 1 || height < 1 || width % 2 == 0 || height % 2 == 0) throw image_error("Kernel sides have to be odd");
+	if (taps.size() != (size_t) width*height) throw image_error("A kernel needs width*height taps");
+}
+
+// A number, or a fraction like 1/16
+static bool parse_tap(const string& token, double& value) {
+	const char* start = token.c_str();
+	char* end;
+
+	value = strtod(start, &end);
+
+	if (end == start) return false;
+
+	if (*end == '/') {
+		const char* denominator_start = end + 1;
+		double denominator = strtod(denominator_start, &end);
+
+		if (end == denominator_start || denominator == 0) return false;
+
+		value /= denominator;
+	}
+
+	return *end == '\0';
+}
+
+conv_kernel conv_kernel::load(const char* filename) {
+	ifstream file(filename);
+
+	if (!file) throw image_error(string("Can't open the kernel ") + filename);
+
+	vector<double> taps;
+	int width = 0;
+	int height = 0;
+	double scale = 1;
+
+	string line;
+
+	while (getline(file, line)) {
+		istringstream words(line.substr(0, line.find('#')));
+		vector<string> tokens;
+		string token;
+
+		while (words >> token) tokens.push_back(token);
+
+		if (tokens.empty()) continue;
+
+		if (tokens[0] == "scale") {
+			if (tokens.size() != 2 || !parse_tap(tokens[1], scale)) throw image_error(string("Bad scale in the kernel ") + filename);
+
+			continue;
+		}
+
+		if (height > 0 && (int) tokens.size() != width) throw image_error(string("The rows of the kernel ") + filename + " aren't all as long");
+
+		for (const string& word : tokens) {
+			double value;
+
+			if (!parse_tap(word, value)) throw image_error("Bad tap " + word + " in the kernel " + filename);
+
+			taps.push_back(value);
+		}
+
+		width = tokens.size();
+		height++;
+	}
+
+	if (height == 0) throw image_error(string("No taps in the kernel ") + filename);
+
+	for (double& value : taps) value *= scale;
+
+	return conv_kernel(width, height, taps);
+}
+
+int conv_kernel::nonzero() const {
+	return m_taps.size() - count(m_taps.begin(), m_taps.end(), 0.0);
+}
+
+// Factors taken through the largest tap, then checked against every tap
+bool conv_kernel::separate(vector<double>& column, vector<double>& row) const {
+	int pivot = 0;
+
+	for (size_t n = 0; n < m_taps.size(); n++) {
+		if (fabs(m_taps[n]) > fabs(m_taps[pivot])) pivot = n;
+	}
+
+	double largest = fabs(m_taps[pivot]);
+
+	if (largest == 0) return false;
+
+	int pivot_i = pivot/m_width;
+	int pivot_j = pivot % m_width;
+
+	row.resize(m_width);
+	column.resize(m_height);
+
+	for (int j = 0; j < m_width; j++) row[j] = tap(pivot_i, j);
+	for (int i = 0; i < m_height; i++) column[i] = tap(i, pivot_j)/m_taps[pivot];
+
+	for (int i = 0; i < m_height; i++) {
+		for (int j = 0; j < m_width; j++) {
+			if (fabs(column[i]*row[j] - tap(i, j)) > 1e-9*largest) return false;
+		}
+	}
+
+	return true;
+}
+
+conv_method conv_method_for(const conv_kernel& kernel) {
+	vector<double> column, row;
+
+	if (kernel.separate(column, row)) {
+		int taps = kernel.width() + kernel.height() - count(column.begin(), column.end(), 0.0) - count(row.begin(), row.end(), 0.0);
+
+		if (taps < kernel.nonzero()) return CONV_SEPARABLE;
+	}
+
+	return (kernel.nonzero() <= CONV_FFT_TAPS) ? CONV_DIRECT : CONV_FFT;
+}
+
+// A tap as an offset from the center and a weight, only the ones that aren't zero are kept
+struct conv_tap {
+	int offset;
+	float weight;
+};
+
+static vector<conv_tap> nonzero_taps(const vector<double>& weights) {
+	vector<conv_tap> taps;
+
+	for (size_t n = 0; n < weights.size(); n++) {
+		if (weights[n] != 0) taps.push_back(conv_tap{(int) n - (int) weights.size()/2, (float) weights[n]});
+	}
+
+	return taps;
+}
+
+static inline Uint8 clamp_round(double value) {
+	return (value <= 0) ? 0 : (value >= 255) ? 255 : (Uint8) (value + 0.5);
+}
+
+// The transforms get within about 1e-12 of the exact sums, but how far off depends on where the tile starts
+// Snapping to a grid of 2^-20 first has sums that fall on a .5 round the same way whatever the tiles, so strips match
+static inline Uint8 snap_round(double value) {
+	return clamp_round(floor(value*(1 << 20) + 0.5)/(1 << 20));
+}
+
+// The channels of the image are planes of width*height bytes one after another
+// Each function fills the rows [ry, height - ry) and columns [rx, width - rx) of dst from src
+
+// Each tap adds a shifted row times its weight to a row of sums, so the inner loops run along whole rows
+static void convolve_direct(const Uint8* src, Uint8* dst, int width, int height, const conv_kernel& kernel) {
+	int rx = kernel.width()/2;
+	int ry = kernel.height()/2;
+	size_t plane = (size_t) width*height;
+
+	// Taps along each row of the kernel
+	vector<vector<conv_tap>> kernel_rows(kernel.height());
+
+	for (int i = 0; i < kernel.height(); i++) {
+		vector<double> weights(kernel.width());
+
+		for (int j = 0; j < kernel.width(); j++) weights[j] = kernel.tap(i, j);
+
+		kernel_rows[i] = nonzero_taps(weights);
+	}
+
+	int rows = height - 2*ry;
+	int count = band_count(rows, 16);
+
+	parallel_for(3*count, [&](int task) {
+		int c = task/count;
+		int band = task % count;
+
+		vector<float> sums(width);
+
+		for (int y = ry + (long) rows*band/count; y < ry + (long) rows*(band + 1)/count; y++) {
+			fill(sums.begin(), sums.end(), 0.0f);
+
+			for (int i = 0; i < kernel.height(); i++) {
+				const Uint8* row_src = src + c*plane + (size_t) (y + i - ry)*width;
+
+				for (const conv_tap& tap : kernel_rows[i]) {
+					const Uint8* shifted = row_src + tap.offset;
+
+					for (int x = rx; x < width - rx; x++) sums[x] += tap.weight*shifted[x];
+				}
+			}
+
+			Uint8* row_dst = dst + c*plane + (size_t) y*width;
+
+			for (int x = rx; x < width - rx; x++) row_dst[x] = clamp_round(sums[x]);
+		}
+	});
+}
+
+// A column pass over whole rows into sums, then a row pass along them
+static void convolve_separable(const Uint8* src, Uint8* dst, int width, int height, const conv_kernel& kernel) {
+	vector<double> column_weights, row_weights;
+
+	if (!kernel.separate(column_weights, row_weights)) throw image_error("The kernel isn't separable");
+
+	vector<conv_tap> column_taps = nonzero_taps(column_weights);
+	vector<conv_tap> row_taps = nonzero_taps(row_weights);
+
+	int rx = kernel.width()/2;
+	int ry = kernel.height()/2;
+	size_t plane = (size_t) width*height;
+
+	int rows = height - 2*ry;
+	int count = band_count(rows, 16);
+
+	parallel_for(3*count, [&](int task) {
+		int c = task/count;
+		int band = task % count;
+
+		vector<float> column_sums(width);
+		vector<float> sums(width);
+
+		for (int y = ry + (long) rows*band/count; y < ry + (long) rows*(band + 1)/count; y++) {
+			fill(column_sums.begin(), column_sums.end(), 0.0f);
+			fill(sums.begin(), sums.end(), 0.0f);
+
+			for (const conv_tap& tap : column_taps) {
+				const Uint8* row_src = src + c*plane + (size_t) (y + tap.offset)*width;
+
+				for (int x = 0; x < width; x++) column_sums[x] += tap.weight*row_src[x];
+			}
+
+			for (const conv_tap& tap : row_taps) {
+				const float* shifted = column_sums.data() + tap.offset;
+
+				for (int x = rx; x < width - rx; x++) sums[x] += tap.weight*shifted[x];
+			}
+
+			Uint8* row_dst = dst + c*plane + (size_t) y*width;
+
+			for (int x = rx; x < width - rx; x++) row_dst[x] = clamp_round(sums[x]);
+		}
+	});
+}
+
+// Written out, std::complex multiplication guards against infinities and NaNs at a large cost
+static inline complex<double> times(const complex<double>& a, const complex<double>& b) {
+	return complex<double>(a.real()*b.real() - a.imag()*b.imag(), a.real()*b.imag() + a.imag()*b.real());
+}
+
+// In place radix-2 FFT of n values stride apart, roots holds exp(-2*pi*i*k/n) for k < n/2
+// The inverse isn't scaled
+static void fft(complex<double>* data, int n, int stride, const vector<complex<double>>& roots, bool inverse) {
+	for (int i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+
+		for (; j & bit; bit >>= 1) j ^= bit;
+
+		j ^= bit;
+
+		if (i < j) swap(data[i*stride], data[j*stride]);
+	}
+
+	for (int length = 2; length <= n; length <<= 1) {
+		int step = n/length;
+
+		for (int i = 0; i < n; i += length) {
+			for (int k = 0; k < length/2; k++) {
+				complex<double> root = inverse ? conj(roots[k*step]) : roots[k*step];
+				complex<double>& a = data[(i + k)*stride];
+				complex<double>& b = data[(i + k + length/2)*stride];
+
+				complex<double> product = times(b, root);
+
+				b = a - product;
+				a += product;
+			}
+		}
+	}
+}
+
+// Rows and then columns of an n x n block
+static void fft_2d(complex<double>* data, int n, const vector<complex<double>>& roots, bool inverse) {
+	for (int y = 0; y < n; y++) fft(data + (size_t) y*n, n, 1, roots, inverse);
+	for (int x = 0; x < n; x++) fft(data + x, n, n, roots, inverse);
+}
+
+// Overlap-save over square tiles of n x n
+// The kernel's spectrum is computed once, each tile is transformed, multiplied by it and transformed back, and the
+// part of the result the kernel fully covers is kept
+// Two channels go through each transform as the real and imaginary parts, the kernel being real keeps them apart
+static void convolve_fft(const Uint8* src, Uint8* dst, int width, int height, const conv_kernel& kernel) {
+	int kw = kernel.width();
+	int kh = kernel.height();
+	int rx = kw/2;
+	int ry = kh/2;
+	size_t plane = (size_t) width*height;
+
+	// Tiles a few times the size of the kernel keep most of each result, but no larger than the image needs
+	int side = max(kw, kh);
+	int n = 64;
+
+	while (n < 4*side) n <<= 1;
+	while (n/2 >= side && n/2 >= max(width, height) + side - 1) n >>= 1;
+
+	vector<complex<double>> roots(n/2);
+
+	for (int k = 0; k < n/2; k++) roots[k] = polar(1.0, -2*M_PI*k/n);
+
+	// The kernel flipped, so the convolution the transforms compute applies it as written
+	vector<complex<double>> spectrum((size_t) n*n);
+
+	for (int i = 0; i < kh; i++) {
+		for (int j = 0; j < kw; j++) spectrum[(size_t) (kh - 1 - i)*n + (kw - 1 - j)] = kernel.tap(i, j);
+	}
+
+	fft_2d(spectrum.data(), n, roots, false);
+
+	// Output pixels each tile produces, and how many tiles cover the output
+	int block_w = n - kw + 1;
+	int block_h = n - kh + 1;
+	int tiles_x = (width - 2*rx + block_w - 1)/block_w;
+	int tiles_y = (height - 2*ry + block_h - 1)/block_h;
+
+	double scale = 1.0/((double) n*n);
+
+	parallel_for(tiles_x*tiles_y, [&](int tile) {
+		int x0 = rx + (tile % tiles_x)*block_w;
+		int y0 = ry + (tile/tiles_x)*block_h;
+		int x_end = min(x0 + block_w, width - rx);
+		int y_end = min(y0 + block_h, height - ry);
+
+		vector<complex<double>> block((size_t) n*n);
+
+		for (int pair = 0; pair < 2; pair++) {
+			const Uint8* real_src = src + 2*pair*plane;
+			const Uint8* imag_src = (pair == 0) ? src + plane : NULL;
+
+			// The input the tile's outputs reach, zero past the image
+			for (int t = 0; t < n; t++) {
+				int y = y0 - ry + t;
+
+				for (int s = 0; s < n; s++) {
+					int x = x0 - rx + s;
+					bool inside = y < height && x < width;
+
+					double real = inside ? real_src[(size_t) y*width + x] : 0;
+					double imag = (inside && imag_src) ? imag_src[(size_t) y*width + x] : 0;
+
+					block[(size_t) t*n + s] = complex<double>(real, imag);
+				}
+			}
+
+			fft_2d(block.data(), n, roots, false);
+
+			for (size_t k = 0; k < block.size(); k++) block[k] = times(block[k], spectrum[k]);
+
+			fft_2d(block.data(), n, roots, true);
+
+			// Outputs the kernel fully covers start kernel - 1 into the block
+			for (int y = y0; y < y_end; y++) {
+				const complex<double>* row = &block[(size_t) (y - y0 + kh - 1)*n + kw - 1];
+
+				for (int x = x0; x < x_end; x++) {
+					dst[2*pair*plane + (size_t) y*width + x] = snap_round(row[x - x0].real()*scale);
+
+					if (imag_src) dst[plane + (size_t) y*width + x] = snap_round(row[x - x0].imag()*scale);
+				}
+			}
+		}
+	});
+}
+
+void convolve(image_io& image_src, const conv_kernel& kernel) {
+	convolve(image_src, kernel, conv_method_for(kernel));
+}
+
+// The channels are split into planes, convolved into a second set and packed back
+void convolve(image_io& image_src, const conv_kernel& kernel, conv_method method) {
+	PROFILE_SCOPE("convolve", (Uint64) image_src.width()*image_src.height());
+
+	int width = image_src.width();
+	int height = image_src.height();
+
+	if (width < kernel.width() || height < kernel.height()) return;
+
+	locker lock(image_src);
+
+	size_t plane = (size_t) width*height;
+	vector<Uint8> src(3*plane);
+
+	int count = band_count(height, 64);
+
+	parallel_for(count, [&](int band) {
+		for (int y = (long) height*band/count; y < (long) height*(band + 1)/count; y++) {
+			size_t offset = (size_t) y*width;
+
+			simd_unpack_row(image_src.row(y), &src[offset], &src[plane + offset], &src[2*plane + offset], width);
+		}
+	});
+
+	// Pixels near the edges keep their values
+	vector<Uint8> dst(src);
+
+	if (method == CONV_SEPARABLE) convolve_separable(src.data(), dst.data(), width, height, kernel);
+	else if (method == CONV_FFT) convolve_fft(src.data(), dst.data(), width, height, kernel);
+	else convolve_direct(src.data(), dst.data(), width, height, kernel);
+
+	// Only the rows the kernel fully covers changed
+	int ry = kernel.height()/2;
+	int rows = height - 2*ry;
+
+	count = band_count(rows, 64);
+
+	parallel_for(count, [&](int band) {
+		for (int y = ry + (long) rows*band/count; y < ry + (long) rows*(band + 1)/count; y++) {
+			size_t offset = (size_t) y*width;
+
+			simd_pack_row(&dst[offset], &dst[plane + offset], &dst[2*plane + offset], image_src.row(y), width);
+		}
+	});
+
+	image_src.invalidate_gray();
+}
@@ -0,0 +1,191 @@
+#include "histogram.h"
+
+#include "bands.h"
+#include "point_ops.h"
+#include "profile.h"
+#include "simd.h"
+#include "transforms.h"
+
+#include <algorithm>
+#include <vector>
+
+
+using namespace std;
+
+histogram::histogram() {
+	for (int c = 0; c < 4; c++) m_bins[c].fill(0);
+}
+
+histogram::histogram(image_io& image_src) : histogram(image_src, point_ops()) {}
+
+// Each band of rows is counted into bins of its own, they're merged once every band is done
+histogram::histogram(image_io& image_src, const point_ops& ops) : histogram() {
+	PROFILE_SCOPE("histogram", (Uint64) image_src.width()*image_src.height());
+
+	locker lock(image_src);
+
+	int height = image_src.height();
+	int count = band_count(height, 16);
+
+	vector<histogram> partials(count);
+
+	parallel_for(count, [&](int i) {
+		int band_begin = (long) height*i/count;
+		int band_end = (long) height*(i + 1)/count;
+
+		partials[i].add_pixels(image_src, ops, 0, band_begin, image_src.width(), band_end - band_begin);
+	});
+
+	for (const histogram& partial : partials) merge(partial);
+}
+
+histogram::histogram(image_io& image_src, int x, int y, int width, int height) : histogram() {
+	add_pixels(image_src, point_ops(), x, y, width, height);
+}
+
+void histogram::add_pixels(image_io& image_src, const point_ops& ops, int x_begin, int y_begin, int width, int height) {
+	// Row buffers for the mapped pixels, then their color planes and gray values
+	vector<Uint32> row_mapped(width);
+	vector<Uint8> planes(4*width);
+
+	// Four sets of bins per channel so runs of the same level don't wait on each other's increments
+	vector<Uint32> bins(4*4*256, 0);
+
+	// Rows the 32-bit counts can take before they're flushed
+	int flush_rows = max((1 << 30)/max(width, 1), 1);
+
+	for (int y = 0; y < height; y++) {
+		const Uint32* row = image_src.row(y_begin + y) + x_begin;
+
+		if (!ops.empty()) {
+			for (int x = 0; x < width; x++) {
+				row_mapped[x] = ops.map(row[x]);
+			}
+
+			row = row_mapped.data();
+		}
+
+		simd_unpack_row(row, &planes[0], &planes[width], &planes[2*width], width);
+		simd_gray_row(row, &planes[3*width], width);
+
+		for (int c = 0; c < 4; c++) {
+			const Uint8* plane = &planes[c*width];
+			Uint32* bins_c = &bins[c*4*256];
+			int x = 0;
+
+			for (; x + 4 <= width; x += 4) {
+				bins_c[plane[x]]++;
+				bins_c[256 + plane[x + 1]]++;
+				bins_c[512 + plane[x + 2]]++;
+				bins_c[768 + plane[x + 3]]++;
+			}
+
+			for (; x < width; x++) bins_c[plane[x]]++;
+		}
+
+		if ((y + 1) % flush_rows == 0 || y + 1 == height) {
+			for (int c = 0; c < 4; c++) {
+				const Uint32* bins_c = &bins[c*4*256];
+
+				for (int j = 0; j < 256; j++) {
+					m_bins[c][j] += (Uint64) bins_c[j] + bins_c[256 + j] + bins_c[512 + j] + bins_c[768 + j];
+				}
+			}
+
+			fill(bins.begin(), bins.end(), 0);
+		}
+	}
+}
+
+void histogram::merge(const histogram& other) {
+	for (int c = 0; c < 4; c++) {
+		for (int j = 0; j < 256; j++) m_bins[c][j] += other.m_bins[c][j];
+	}
+}
+
+Uint64 histogram::total() const {
+	Uint64 total_sum = 0;
+
+	for (int j = 0; j < 256; j++) total_sum += m_bins[H_GRAY][j];
+
+	return total_sum;
+}
+
+std::array<std::array<Uint8, 256>, 3> histogram::equalization(double clip_limit) const {
+	array<array<Uint8, 256>, 3> lut;
+
+	for (int c = 0; c < 3; c++) {
+		Uint64 level_sum[256];
+		Uint64 level_integral[256];
+
+		for (int j = 0; j <= 255; j++) level_sum[j] = m_bins[c][j];
+
+		if (clip_limit > 0) {
+			// Clip the bins at a multiple of the mean count
+			Uint64 clip_count = max((Uint64) (clip_limit*total()/256), (Uint64) 1);
+			Uint64 excess = 0;
+
+			for (int j = 0; j <= 255; j++) {
+				if (level_sum[j] > clip_count) {
+					excess += level_sum[j] - clip_count;
+					level_sum[j] = clip_count;
+				}
+			}
+
+			// Spread what was clipped off evenly over every level, the remainder a count each to the lowest levels
+			for (int j = 0; j <= 255; j++) level_sum[j] += excess/256 + ((Uint64) j < excess % 256);
+		}
+
+		// Integrate over the intensity levels
+		level_integral[0] = level_sum[0];
+
+		for (int j = 1; j <= 255; j++) {
+			level_integral[j] = level_sum[j] + level_integral[j - 1];
+		}
+
+		// Use the integral as the transfer function of each level
+		for (int j = 0; j <= 255; j++) {
+			Uint32 value_scaled = 255.0*level_integral[j]/((double) level_integral[255]);
+
+			lut[c][j] = value_scaled;
+		}
+	}
+
+	return lut;
+}
+
+Uint32 histogram::otsu_threshold() const {
+	const array<Uint64, 256>& bins = m_bins[H_GRAY];
+
+	double weight_total = 0, sum_total = 0;
+
+	for (int j = 0; j <= 255; j++) {
+		weight_total += bins[j];
+		sum_total += (double) j*bins[j];
+	}
+
+	// A single level can't be split, fall back on the middle
+	Uint32 threshold = 128;
+	double variance_max = -1;
+	double weight_dark = 0, sum_dark = 0;
+
+	// Levels up to j are the dark class, the rest the bright one
+	for (int j = 0; j < 255; j++) {
+		weight_dark += bins[j];
+		sum_dark += (double) j*bins[j];
+
+		double weight_bright = weight_total - weight_dark;
+
+		if (weight_dark == 0 || weight_bright == 0) continue;
+
+		double mean_difference = sum_dark/weight_dark - (sum_total - sum_dark)/weight_bright;
+		double variance = weight_dark*weight_bright*mean_difference*mean_difference;
+
+		if (variance > variance_max) {
+			variance_max = variance;
+			threshold = j + 1;
+		}
+	}
+
+	return threshold;
+}
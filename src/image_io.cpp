@@ -1,32 +1,181 @@
 #include "image_io.h"
 
-#include <iostream>
+#include "bands.h"
+#include "profile.h"
+#include "raw_file.h"
+#include "simd.h"
+
+#include <cstring>
+#include <string>
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
 
 
 using namespace std;
 
+// Masks of the packed 32-bit format every image is normalized to
+#define NORM_RMASK 0x000000FF
+#define NORM_GMASK 0x0000FF00
+#define NORM_BMASK 0x00FF0000
+
 // Parameterized constructor
 // Pass it a filename to open an instance of that file
-image_io::image_io(const char* filename) {
-	m_image = IMG_Load_RW(SDL_RWFromFile(filename, "rb"), 0);
+image_io::image_io(const char* filename) : m_image(NULL), m_file_output(false), m_gray_valid(false) {
+	open(filename, NULL);
+}
 
-	// Exit on an error
-	if (!m_image) {
-		cout << "IMG_Load_RW: " << IMG_GetError();
+image_io::image_io(const char* filename, const char* output_file) : m_image(NULL), m_file_output(false), m_gray_valid(false) {
+	open(filename, output_file);
+}
 
-		exit(1);
+// Surfaces wrapped around pixels of their own have to be checked against the width SDL can hold
+static void check_width(int width) {
+	if (width > IMAGE_MAX_WIDTH) {
+		throw image_error("Images wider than " + to_string(IMAGE_MAX_WIDTH) + " pixels don't fit in an SDL surface");
 	}
 }
 
+// The file is mapped, uncompressed formats are read straight out of it and anything else is decoded by SDL_image from memory
+void image_io::open(const char* filename, const char* output_file) {
+	unique_ptr<mapped_file> input(new mapped_file(filename));
+	raw_layout layout;
+
+	// Creating the output would cut the input short
+	if (output_file && (raw_format_for(output_file) != RAW_BMP || same_file(filename, output_file))) output_file = NULL;
+
+	if (!layout.parse(input->data(), input->size())) {
+		// Let SDL_image free the memory source once it's read
+		m_image = IMG_Load_RW(SDL_RWFromMem(input->data(), input->size()), 1);
+
+		if (!m_image) throw image_error(string("IMG_Load_RW: ") + IMG_GetError());
+
+		PROFILE_ALLOC((Uint64) m_image->pitch*m_image->h);
+
+		normalize();
+
+		if (output_file) {
+			SDL_Surface* image_decoded = m_image;
+
+			try {
+				create_mapped(output_file, image_decoded->w, image_decoded->h);
+			}
+			catch (...) {
+				SDL_FreeSurface(image_decoded);
+
+				throw;
+			}
+
+			for (int y = 0; y < height(); y++) {
+				memcpy(row(y), (Uint8*) image_decoded->pixels + y*image_decoded->pitch, width()*sizeof(Uint32));
+			}
+
+			SDL_FreeSurface(image_decoded);
+		}
+
+		return;
+	}
+
+	if (output_file) {
+		create_mapped(output_file, layout.width(), layout.height());
+	}
+	else if (layout.packed()) {
+		check_width(layout.width());
+
+		// Already in the packed format, the pixels are used where they are
+		m_image = SDL_CreateRGBSurfaceFrom(layout.row(input->data(), 0), layout.width(), layout.height(), 32,
+											layout.width()*sizeof(Uint32), NORM_RMASK, NORM_GMASK, NORM_BMASK, 0);
+
+		if (!m_image) throw image_error(string("SDL_CreateRGBSurfaceFrom: ") + SDL_GetError());
+
+		m_file = move(input);
+		m_file_name = filename;
+
+		return;
+	}
+	else {
+		m_image = SDL_CreateRGBSurface(SDL_SWSURFACE, layout.width(), layout.height(), 32,
+										NORM_RMASK, NORM_GMASK, NORM_BMASK, 0);
+
+		if (!m_image) throw image_error(string("SDL_CreateRGBSurface: ") + SDL_GetError());
+
+		PROFILE_ALLOC((Uint64) m_image->pitch*m_image->h);
+	}
+
+	for (int y = 0; y < height(); y++) layout.read_row(input->data(), y, row(y));
+}
+
+void image_io::create_mapped(const char* output_file, int width, int height) {
+	// Checked before the output is created, a failed load shouldn't leave an empty file behind
+	check_width(width);
+
+	raw_layout layout(RAW_BMP, width, height);
+	unique_ptr<mapped_file> output(new mapped_file(output_file, layout.size()));
+
+	PROFILE_ALLOC(layout.size());
+
+	layout.write_header(output->data());
+
+	m_image = SDL_CreateRGBSurfaceFrom(layout.row(output->data(), 0), width, height, 32,
+										width*sizeof(Uint32), NORM_RMASK, NORM_GMASK, NORM_BMASK, 0);
+
+	if (!m_image) throw image_error(string("SDL_CreateRGBSurfaceFrom: ") + SDL_GetError());
+
+	m_file = move(output);
+	m_file_name = output_file;
+	m_file_output = true;
+}
+
+void image_io::detach() {
+	SDL_Surface* image_copy = SDL_ConvertSurface(m_image, m_image->format, SDL_SWSURFACE);
+
+	if (!image_copy) throw image_error(string("SDL_ConvertSurface: ") + SDL_GetError());
+
+	PROFILE_ALLOC((Uint64) image_copy->pitch*image_copy->h);
+
+	SDL_FreeSurface(m_image);
+	m_image = image_copy;
+
+	m_file.reset();
+	m_file_name.clear();
+	m_file_output = false;
+}
+
+// Blank image constructor
+image_io::image_io(int width, int height) : m_file_output(false), m_gray_valid(false) {
+	m_image = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32,
+									NORM_RMASK, NORM_GMASK, NORM_BMASK, 0);
+
+	if (!m_image) throw image_error(string("SDL_CreateRGBSurface: ") + SDL_GetError());
+
+	PROFILE_ALLOC((Uint64) m_image->pitch*m_image->h);
+}
+
+// Surface constructor
+// Takes ownership of the surface
+image_io::image_io(SDL_Surface* image) : m_image(image), m_file_output(false), m_gray_valid(false) {
+	normalize();
+}
+
+// View constructor
+// SDL doesn't free pixels it was handed, only the surface around them
+image_io::image_io(image_io& image, int y, int height) : m_file_output(false), m_gray_valid(false) {
+	m_image = SDL_CreateRGBSurfaceFrom(image.row(y), image.width(), height, 32, image.m_image->pitch,
+									NORM_RMASK, NORM_GMASK, NORM_BMASK, 0);
+
+	if (!m_image) throw image_error(string("SDL_CreateRGBSurfaceFrom: ") + SDL_GetError());
+}
+
 // Copy constructor
 // Ideas taken from http://www.libsdl.org/cgi/docwiki.cgi/SDL_Surface
-image_io::image_io(const image_io& image_old) {
+image_io::image_io(const image_io& image_old) : m_file_output(false), m_gray_valid(false) {
 	// Copy the surface
 	m_image = SDL_ConvertSurface(image_old.m_image,
 									image_old.m_image->format,
 									image_old.m_image->flags);
+
+	if (!m_image) throw image_error(string("SDL_ConvertSurface: ") + SDL_GetError());
+
+	PROFILE_ALLOC((Uint64) m_image->pitch*m_image->h);
 }
 
 // Destructor
@@ -38,66 +187,196 @@ image_io::~image_io() {
 SDL_Surface* image_io::get_image() { return m_image; }
 
 void image_io::write(const char* filename) {
-	// Exits with -1 on error
-	if (SDL_SaveBMP(m_image, filename)) {
-		cout << "IMG_SaveBMP: " << IMG_GetError();
+	if (m_file && same_file(filename, m_file_name.c_str())) {
+		// The pixels are already in the file
+		if (m_file_output) return;
+
+		// Writing over the file the pixels are mapped from, they have to be taken out of it first
+		detach();
+	}
+
+	raw_layout layout(raw_format_for(filename), width(), height());
+	mapped_file file(filename, layout.size());
 
-		exit(1);
+	layout.write_header(file.data());
+
+	for (int y = 0; y < height(); y++) layout.write_row(file.data(), y, row(y));
+}
+
+// Readers for the formats SDL_image decodes to, each turns the pixel at one address into the packed format
+// One is picked for the whole surface, the loops over the rows don't branch on the format
+
+// 8-bit, an index into the palette
+struct paletted_format {
+	static const int bytes = 1;
+
+	Uint32 colors[256];
+
+	paletted_format(const SDL_Palette* palette) {
+		for (int i = 0; i < 256; i++) {
+			colors[i] = (i < palette->ncolors) ? palette->colors[i].r | palette->colors[i].g << 8 | palette->colors[i].b << 16 : 0;
+		}
+	}
+
+	Uint32 operator()(const Uint8* pixel) const { return colors[pixel[0]]; }
+};
+
+// 16 or 32 bits in the byte order of the machine, each channel under a mask
+// Channels narrower than 8 bits are shifted up into the top of their byte, the way SDL's blits convert them
+template<class T>
+struct masked_format {
+	static const int bytes = sizeof(T);
+
+	Uint32 masks[3];
+	int shifts[3];
+	int losses[3];
+
+	masked_format(const SDL_PixelFormat* format)
+		: masks{format->Rmask, format->Gmask, format->Bmask},
+		shifts{format->Rshift, format->Gshift, format->Bshift},
+		losses{format->Rloss, format->Gloss, format->Bloss} {}
+
+	Uint32 operator()(const Uint8* pixel) const {
+		T value;
+
+		memcpy(&value, pixel, sizeof(T));
+
+		return (((value & masks[0]) >> shifts[0]) << losses[0])
+			| (((value & masks[1]) >> shifts[1]) << losses[1]) << 8
+			| (((value & masks[2]) >> shifts[2]) << losses[2]) << 16;
 	}
+};
+
+// 24 bits with each channel a byte of its own
+// SDL reads 3 byte pixels in the byte order of the machine, which decides the byte each mask lands on
+struct bytes24_format {
+	static const int bytes = 3;
+
+	int offsets[3];
+
+	bytes24_format(const SDL_PixelFormat* format) {
+		int shifts[3] = {format->Rshift, format->Gshift, format->Bshift};
+
+		for (int c = 0; c < 3; c++) offsets[c] = (SDL_BYTEORDER == SDL_LIL_ENDIAN) ? shifts[c]/8 : 2 - shifts[c]/8;
+	}
+
+	Uint32 operator()(const Uint8* pixel) const {
+		return pixel[offsets[0]] | pixel[offsets[1]] << 8 | pixel[offsets[2]] << 16;
+	}
+};
+
+// Every channel fits in a byte
+static bool byte_channels(const SDL_PixelFormat* format) {
+	return (format->Rmask >> format->Rshift) <= 0xFF && (format->Gmask >> format->Gshift) <= 0xFF && (format->Bmask >> format->Bshift) <= 0xFF;
 }
 
-// Function taken from http://www.libsdl.org/cgi/docwiki.cgi/Pixel_Access
-Uint32 image_io::get_pixel(int x, int y) {
-	int bpp = m_image->format->BytesPerPixel;
-	/* Here p is the address to the pixel we want to retrieve */
-	Uint8 *p = (Uint8*) m_image->pixels + y*m_image->pitch + x*bpp;
-
-	switch(bpp) {
-		case 1:
-			return *p;
-		case 2:
-			return *(Uint16*) p;
-		case 3:
-			if(SDL_BYTEORDER == SDL_BIG_ENDIAN) {
-				return ((p[0] << 16) | (p[1] << 8) | p[2]);
-			}
-			else {
-				return (p[0] | (p[1] << 8) | (p[2] << 16));
-			}
-		case 4:
-			return *(Uint32*) p;
-		default:
-			return 0;	/* shouldn't happen, but avoids warnings */
+// Every channel is a whole byte
+static bool whole_byte_channels(const SDL_PixelFormat* format) {
+	return format->Rmask == (Uint32) 0xFF << format->Rshift && format->Rshift % 8 == 0
+		&& format->Gmask == (Uint32) 0xFF << format->Gshift && format->Gshift % 8 == 0
+		&& format->Bmask == (Uint32) 0xFF << format->Bshift && format->Bshift % 8 == 0;
+}
+
+// Rows are converted in bands on the thread pool
+template<class Format>
+static void convert_rows(const SDL_Surface* src, SDL_Surface* dst, const Format& format) {
+	int w = src->w;
+	int h = src->h;
+	int count = band_count(h, 64);
+
+	parallel_for(count, [&](int i) {
+		for (int y = (long) h*i/count; y < (long) h*(i + 1)/count; y++) {
+			const Uint8* pixel = (const Uint8*) src->pixels + (size_t) y*src->pitch;
+			Uint32* row_dst = (Uint32*) ((Uint8*) dst->pixels + (size_t) y*dst->pitch);
+
+			for (int x = 0; x < w; x++, pixel += Format::bytes) row_dst[x] = format(pixel);
+		}
+	});
+}
+
+// Convert src into dst, a packed 32-bit surface of the same size, false if there's no reader for its format
+static bool convert_surface(SDL_Surface* src, SDL_Surface* dst) {
+	const SDL_PixelFormat* format = src->format;
+	bool converted = true;
+
+	if (SDL_MUSTLOCK(src)) SDL_LockSurface(src);
+
+	if (format->BitsPerPixel == 8 && format->palette) convert_rows(src, dst, paletted_format(format->palette));
+	else if (format->BitsPerPixel == 16 && byte_channels(format)) convert_rows(src, dst, masked_format<Uint16>(format));
+	else if (format->BitsPerPixel == 24 && whole_byte_channels(format)) convert_rows(src, dst, bytes24_format(format));
+	else if (format->BitsPerPixel == 32 && byte_channels(format)) convert_rows(src, dst, masked_format<Uint32>(format));
+	else converted = false;
+
+	if (SDL_MUSTLOCK(src)) SDL_UnlockSurface(src);
+
+	return converted;
+}
+
+// Convert the surface to the packed 32-bit format if it isn't already
+// 32-bit surfaces always have a pitch of exactly 4*w so rows are tightly packed
+// Formats without a reader above go through SDL_ConvertSurface
+void image_io::normalize() {
+	SDL_PixelFormat* format = m_image->format;
+
+	if (format->BitsPerPixel == 32
+			&& format->Rmask == NORM_RMASK
+			&& format->Gmask == NORM_GMASK
+			&& format->Bmask == NORM_BMASK) {
+		return;
+	}
+
+	SDL_Surface* image_converted = SDL_CreateRGBSurface(SDL_SWSURFACE, m_image->w, m_image->h, 32,
+									NORM_RMASK, NORM_GMASK, NORM_BMASK, 0);
+
+	// Called from the constructors, nothing else would free the surface
+	if (!image_converted) {
+		SDL_FreeSurface(m_image);
+
+		throw image_error(string("SDL_CreateRGBSurface: ") + SDL_GetError());
+	}
+
+	if (!convert_surface(m_image, image_converted)) {
+		SDL_Surface* image_packed = image_converted;
+
+		image_converted = SDL_ConvertSurface(m_image, image_packed->format, SDL_SWSURFACE);
+		SDL_FreeSurface(image_packed);
+
+		if (!image_converted) {
+			SDL_FreeSurface(m_image);
+
+			throw image_error(string("SDL_ConvertSurface: ") + SDL_GetError());
+		}
 	}
+
+	PROFILE_ALLOC((Uint64) image_converted->pitch*image_converted->h);
+
+	SDL_FreeSurface(m_image);
+	m_image = image_converted;
 }
 
-// Function taken from http://www.libsdl.org/cgi/docwiki.cgi/Pixel_Access
+Uint32 image_io::get_pixel(int x, int y) { return row(y)[x]; }
+
 void image_io::put_pixel(int x, int y, Uint32 pixel) {
-	int bpp = m_image->format->BytesPerPixel;
-	/* Here p is the address to the pixel we want to set */
-	Uint8 *p = (Uint8*) m_image->pixels + y*m_image->pitch + x*bpp;
-
-	switch(bpp) {
-		case 1:
-			*p = pixel;
-			break;
-		case 2:
-			*(Uint16*) p = pixel;
-			break;
-		case 3:
-			if(SDL_BYTEORDER == SDL_BIG_ENDIAN) {
-				p[0] = (pixel >> 16) & 0xFF;
-				p[1] = (pixel >> 8) & 0xFF;
-				p[2] = pixel & 0xFF;
-			}
-			else {
-				p[0] = pixel & 0xFF;
-				p[1] = (pixel >> 8) & 0xFF;
-				p[2] = (pixel >> 16) & 0xFF;
-			}
-			break;
-		case 4:
-			*(Uint32*) p = pixel;
-			break;
-	}
+	row(y)[x] = pixel;
+
+	m_gray_valid = false;
+}
+
+// Rows are converted in bands on the thread pool
+const Uint8* image_io::gray() {
+	if (m_gray_valid) return m_gray.data();
+
+	int w = width();
+	int h = height();
+	int count = band_count(h, 64);
+
+	m_gray.resize((size_t) w*h);
+
+	parallel_for(count, [&](int i) {
+		for (int y = (long) h*i/count; y < (long) h*(i + 1)/count; y++) simd_gray_row(row(y), &m_gray[(size_t) y*w], w);
+	});
+
+	m_gray_valid = true;
+
+	return m_gray.data();
 }
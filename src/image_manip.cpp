@@ -1,81 +1,548 @@
 #include "image_manip.h"
 
+#include "histogram.h"
+#include "pipeline.h"
+#include "profile.h"
+#include "raw_file.h"
+#include "stream.h"
+#include "strip_io.h"
+
+#include <dirent.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <string>
 #include <array>
+#include <vector>
 
 
 using namespace std;
 
-int main(int argc, char** argv) {
-	// Initialize command line flags
-	// Threshold flags
-	int t_flag = 0;
-	int t_value = 0;
+// Long options, numbered past every short option
+enum {
+	OPT_BATCH = 256,
+	OPT_IN_DIR,
+	OPT_OUT_DIR,
+	OPT_STAGES,
+	OPT_QUEUE,
+	OPT_PIPELINE_STATS,
+	OPT_STREAM,
+	OPT_PROFILE,
+	OPT_COUNTERS
+};
+
+// Print the measurements asked for in options
+static void print_measurements(const manip_options& options, const shape_stats& stats, ostream& out) {
+	if (options.p_flag) {
+		out << "Perimiter is: " << stats.perimeter << endl;
+	}
+	if (options.a_flag) {
+		out << "Area is: " << stats.area << endl;
+	}
+	if (options.m_flag || options.v_flag || options.e_flag) {
+		auto moment_results = stats.moments();
+		auto centroid_results = centroid(moment_results);
+		auto central_moment_results = central_moments(moment_results, centroid_results);
+
+		if (options.m_flag) {
+			out << "M00 is: " << moment_results[0][0] << endl;
+			out << "M01 is: " << moment_results[0][1] << endl;
+			out << "M02 is: " << moment_results[0][2] << endl;
+			out << "M03 is: " << moment_results[0][3] << endl;
+			out << "M10 is: " << moment_results[1][0] << endl;
+			out << "M20 is: " << moment_results[2][0] << endl;
+			out << "M30 is: " << moment_results[3][0] << endl;
+			out << "M11 is: " << moment_results[1][1] << endl;
+			out << "M12 is: " << moment_results[1][2] << endl;
+			out << "M21 is: " << moment_results[2][1] << endl;
+
+			out << "Centroid is: (" << centroid_results[0] << ", ";
+			out << centroid_results[1] << ")" << endl;
+
+			out << "U00 is: " << central_moment_results[0][0] << endl;
+			out << "U02 is: " << central_moment_results[0][2] << endl;
+			out << "U03 is: " << central_moment_results[0][3] << endl;
+			out << "U20 is: " << central_moment_results[2][0] << endl;
+			out << "U30 is: " << central_moment_results[3][0] << endl;
+			out << "U11 is: " << central_moment_results[1][1] << endl;
+			out << "U12 is: " << central_moment_results[1][2] << endl;
+			out << "U21 is: " << central_moment_results[2][1] << endl;
+		}
+
+		if (options.v_flag) {
+			auto invariant_results = invariants(central_moment_results);
+
+			out << "I0 is: " << invariant_results[0] << endl;
+			out << "I1 is: " << invariant_results[1] << endl;
+			out << "I2 is: " << invariant_results[2] << endl;
+			out << "I3 is: " << invariant_results[3] << endl;
+			out << "I4 is: " << invariant_results[4] << endl;
+			out << "I5 is: " << invariant_results[5] << endl;
+			out << "I6 is: " << invariant_results[6] << endl;
+		}
+
+		if (options.e_flag) {
+			auto eigen_results = eigen(moment_results, centroid_results);
+
+			out << "L1 is: " << eigen_results[0][0] << endl;
+			out << "L2 is: " << eigen_results[1][0] << endl;
 
-	// Dilation flags
-	int d_flag = 0;
-	int d_value = 0;
+			out << "V1 is: (" << eigen_results[0][1] << ", " << eigen_results[0][2] << ")" << endl;
+			out << "V2 is: (" << eigen_results[1][1] << ", " << eigen_results[1][2] << ")" << endl;
+		}
+	}
+}
+
+// Run the operations in options on an image, measurements are printed to out
+static void manip_image(const manip_options& options, image_io& image, ostream& out) {
+	// Do the the operations specified by the command line switches
+	// Operations in roughly ascending order of destructiveness
+	// Compose the mask and mask off specified colors
+	// Runs of point operations are queued up and applied in a single pass
+	point_ops ops;
+
+	int c_mask = (options.c_r_flag*M_RED | options.c_g_flag*M_GREEN | options.c_b_flag*M_BLUE);
+	if (options.c_flag) ops.add_color_mask(c_mask);
+	if (options.i_flag) ops.add_invert();
+
+	// Neighborhood operations need the queued point operations applied first
+	if (options.s_mean_flag || options.s_med_flag || options.k_flag) ops.apply(image);
+	if (options.s_mean_flag) smooth_mean(image, options.s_mean_radius);
+	if (options.s_med_flag) smooth_median(image, options.s_med_radius);
+	if (options.k_flag) convolve(image, options.k_kernel);
+
+	if (options.h_adaptive_flag) {
+		// Not a point operation, every pixel depends on where it is
+		ops.apply(image);
+		hist_eq_adaptive(image, options.h_tiles, options.h_clip);
+	}
+	else if (options.h_flag) ops.add_hist_eq(image);
 
-	// Erosion flags
-	int r_flag = 0;
-	int r_value = 0;
+	if (options.t_flag && options.t_otsu_flag) ops.add_otsu_threshold(image);
+	else if (options.t_flag) ops.add_threshold(options.t_value);
 
-	// Sobel gradient flag
-	int g_flag = 0;
+	// Area, perimeter and moments all come out of a single pass
+	int shape_flag = options.p_flag || options.a_flag || options.m_flag || options.v_flag || options.e_flag;
+	shape_stats stats;
 
-	// Laplace flag
-	int l_flag = 0;
+	// A threshold leaves a black and white image, the binary transforms can then work on it at one bit per pixel
+	if (options.t_flag && (options.d_flag || options.r_flag || shape_flag)) {
+		binary_image binary(image.width(), image.height());
+		ops.apply(image, binary);
 
-	// Perimiter flag
-	int p_flag = 0;
+		if (options.d_flag) dilation(binary, options.d_value);
+		if (options.r_flag) erosion(binary, options.r_value);
+		if (shape_flag) stats = shape_statistics(binary);
 
-	// Area flag
-	int a_flag = 0;
+		binary.write(image);
+	}
+	else {
+		ops.apply(image);
 
-	// Moment flag
-	int m_flag = 0;
+		if (options.d_flag) dilation(image, options.d_value);
+		if (options.r_flag) erosion(image, options.r_value);
+		if (shape_flag) stats = shape_statistics(image);
+	}
 
-	// Invariant flag
-	int v_flag = 0;
+	print_measurements(options, stats, out);
 
-	// Eigen flag
-	int e_flag = 0;
+	// Edge Detection
+	if (options.g_flag) sobel_gradient(image, options.g_output);
+	if (options.l_flag) laplacian(image);
+}
 
-	// Invert flag
-	int i_flag = 0;
+// Stage applying a copy of the queued point operations to every strip
+static strip_stage point_stage(const point_ops& ops) {
+	return strip_stage(0, [ops](image_io& strip) {
+		point_ops pending = ops;
 
-	// Smooth method
-	int s_med_flag = 0;
-	int s_mean_flag = 0;
-	string s_args;
+		pending.apply(strip);
+	});
+}
+
+// Histogram of the image as the stages so far and the queued point operations leave it
+// Costs a pass over the input, there's nowhere to keep the image in between
+static histogram stream_histogram(const char* input_file, vector<strip_stage> stages, const point_ops& ops, int strip_rows) {
+	histogram counts;
+
+	stages.push_back(point_stage(ops));
+	stages.push_back(strip_stage(0, nullptr, [&](image_io& strip, int begin, int end, int) {
+		counts.merge(histogram(strip, 0, begin, strip.width(), end - begin));
+	}));
+
+	run_stream(input_file, stages, strip_rows);
+
+	return counts;
+}
+
+// Same operations as manip_image, but the image is read, transformed and written strip_rows rows at a time
+// so it never has to fit in memory
+// The input has to be an uncompressed BMP, PPM or PGM, throws image_error
+static void manip_stream(const manip_options& options, const char* input_file, const char* output_file, int strip_rows, ostream& out) {
+	if (options.h_adaptive_flag) throw image_error("Adaptive histogram equalization can't be streamed");
+	// Creating the output cuts it to its new size, which would wipe the input while it's still being read
+	if (same_file(input_file, output_file)) throw image_error("Streaming can't write over its input, pick another output file");
+
+	vector<strip_stage> stages;
+	point_ops ops;
+
+	// Turn the queued point operations into a stage of their own
+	auto flush_ops = [&]() {
+		if (!ops.empty()) stages.push_back(point_stage(ops));
+
+		ops.clear();
+	};
+
+	int c_mask = (options.c_r_flag*M_RED | options.c_g_flag*M_GREEN | options.c_b_flag*M_BLUE);
+	if (options.c_flag) ops.add_color_mask(c_mask);
+	if (options.i_flag) ops.add_invert();
+
+	// Each neighborhood transform reads as many rows past its own as its radius
+	if (options.s_mean_flag || options.s_med_flag || options.k_flag) flush_ops();
+
+	if (options.s_mean_flag) {
+		int radius = options.s_mean_radius;
+
+		stages.push_back(strip_stage(max(radius, 0), [radius](image_io& strip) { smooth_mean(strip, radius); }));
+	}
+
+	if (options.s_med_flag) {
+		int radius = options.s_med_radius;
+
+		stages.push_back(strip_stage(max(min(radius, 127), 0), [radius](image_io& strip) { smooth_median(strip, radius); }));
+	}
+
+	if (options.k_flag) {
+		const conv_kernel& kernel = options.k_kernel;
+
+		stages.push_back(strip_stage(kernel.height()/2, [&kernel](image_io& strip) { convolve(strip, kernel); }));
+	}
+
+	if (options.h_flag) ops.add_lut(stream_histogram(input_file, stages, ops, strip_rows).equalization());
+
+	if (options.t_flag && options.t_otsu_flag) ops.add_threshold(stream_histogram(input_file, stages, ops, strip_rows).otsu_threshold());
+	else if (options.t_flag) ops.add_threshold(options.t_value);
+
+	flush_ops();
+
+	// Dilation skips black pixels on the first and last rows of its strip, one more row keeps them out of reach
+	if (options.d_flag) {
+		int n = options.d_value;
+
+		stages.push_back(strip_stage(max(n, 0) + 1, [n](image_io& strip) { dilation(strip, n); }));
+	}
+
+	if (options.r_flag) {
+		int n = options.r_value;
+
+		stages.push_back(strip_stage(max(n, 0) + 1, [n](image_io& strip) { erosion(strip, n); }));
+	}
+
+	// Only the size is needed up front
+	int width, height;
+
+	{
+		strip_reader header(input_file);
+
+		width = header.width();
+		height = header.height();
+	}
+
+	int shape_flag = options.p_flag || options.a_flag || options.m_flag || options.v_flag || options.e_flag;
+	shape_stats stats;
+
+	if (shape_flag) {
+		stages.push_back(strip_stage(1, nullptr, [&](image_io& strip, int begin, int end, int y_first) {
+			stats.merge(shape_statistics(strip, begin, end, y_first, height));
+		}));
+	}
+
+	if (options.g_flag) {
+		sobel_output output = options.g_output;
+
+		stages.push_back(strip_stage(1, [output](image_io& strip) { sobel_gradient(strip, output); }));
+	}
+
+	if (options.l_flag) stages.push_back(strip_stage(1, laplacian));
+
+	strip_writer writer(output_file, width, height);
+
+	stages.push_back(strip_stage(0, nullptr, [&](image_io& strip, int begin, int end, int) {
+		PROFILE_SCOPE("save", (Uint64) strip.width()*(end - begin));
+
+		writer.write(strip, begin, end);
+	}));
+
+	run_stream(input_file, stages, strip_rows);
+
+	print_measurements(options, stats, out);
+}
+
+// Output file of an image in a batch, its name with a .bmp extension in out_dir
+static string batch_output(const string& input_file, const string& out_dir) {
+	size_t name_pos = input_file.find_last_of('/');
+	string name = (name_pos == string::npos) ? input_file : input_file.substr(name_pos + 1);
+
+	size_t extension_pos = name.find_last_of('.');
+	if (extension_pos != string::npos && extension_pos > 0) name.erase(extension_pos);
+
+	return out_dir + "/" + name + ".bmp";
+}
+
+// Add the regular files of a directory in name order, skipping hidden ones
+static bool list_directory(const string& in_dir, vector<string>& input_files) {
+	DIR* dir = opendir(in_dir.c_str());
+
+	if (!dir) return false;
+
+	while (dirent* entry = readdir(dir)) {
+		if (entry->d_name[0] == '.') continue;
+
+		string path = in_dir + "/" + entry->d_name;
+		struct stat info;
+
+		if (stat(path.c_str(), &info) == 0 && S_ISREG(info.st_mode)) input_files.push_back(path);
+	}
+
+	closedir(dir);
+
+	sort(input_files.begin(), input_files.end());
+
+	return true;
+}
+
+// Add the files listed one per line
+static bool list_file(const string& batch_file, vector<string>& input_files) {
+	ifstream list(batch_file.c_str());
+
+	if (!list) return false;
+
+	string line;
+
+	while (getline(list, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+		if (!line.empty()) input_files.push_back(line);
+	}
+
+	return true;
+}
+
+// Threads of the decode, transform and encode stages of a batch, and the room in the queues between them
+struct batch_settings {
+	batch_settings() : queue(0), stats_flag(0) {
+		stages[0] = 1;
+		stages[1] = 0;
+		stages[2] = 1;
+	}
+
+	// 0 transform threads uses every core, a queue of 0 twice as many images as there are transform threads
+	int stages[3];
+	int queue;
+	int stats_flag;
+};
+
+// An image on its way through the batch pipeline
+struct batch_job {
+	int index;
+	unique_ptr<image_io> image;
+};
+
+// Print the counters of a batch, how busy each stage kept its threads and how full the queues ran
+static void print_pipeline_stats(const pipeline_counters& counters) {
+	static const char* stage_names[3] = {"decode", "transform", "encode"};
+	static const char* queue_names[2] = {"decode -> transform", "transform -> encode"};
+
+	double wall = max(counters.wall, (Uint64) 1);
+
+	cout << fixed << setprecision(1);
+	cout << "Pipeline: " << counters.wall/1e6 << " ms\n";
+
+	for (int s = 0; s < 3; s++) {
+		const stage_counters& stage = counters.stages[s];
+
+		cout << "  " << stage_names[s] << ": " << stage.threads << " threads, " << stage.items.load() << " images, "
+			<< 100*stage.busy.load()/(wall*stage.threads) << "% busy, "
+			<< 100*stage.blocked.load()/(wall*stage.threads) << "% blocked\n";
+	}
+
+	for (int q = 0; q < 2; q++) {
+		const queue_counters& queue = counters.queues[q];
+
+		cout << "  " << queue_names[q] << ": capacity " << queue.capacity << ", mean depth "
+			<< (double) queue.depth_sum.load()/max(queue.pushes.load(), (Uint64) 1) << ", max depth " << queue.depth_max.load() << "\n";
+	}
+}
+
+// Run the same operations on every image
+// Decoding, transforming and encoding are stages with threads of their own connected by bounded queues, so the disk
+// and the cores are kept busy at the same time while only a few images are held in memory
+// An image that fails is reported and the rest carry on
+// Images that would be written to the same output file are reported before anything runs, they'd overwrite each other
+static int manip_batch(const manip_options& options, const vector<string>& input_files, const string& out_dir,
+						const batch_settings& settings) {
+	vector<string> output_files(input_files.size());
+	map<string, size_t> first_input;
+	int collisions = 0;
+
+	for (size_t i = 0; i < input_files.size(); i++) {
+		output_files[i] = batch_output(input_files[i], out_dir);
+
+		auto first = first_input.insert(make_pair(output_files[i], i));
+
+		if (!first.second) {
+			cout << input_files[i] << ": same output file " << output_files[i] << " as " << input_files[first.first->second] << endl;
+			collisions++;
+		}
+	}
 
-	// Histogram equalization flag
-	int h_flag = 0;
+	if (collisions) {
+		cout << collisions << " images share an output file, nothing was written\n";
+
+		return 1;
+	}
+
+	vector<string> outputs(input_files.size());
+	vector<string> errors(input_files.size());
+
+	int threads[3];
+
+	for (int s = 0; s < 3; s++) threads[s] = settings.stages[s];
+	if (threads[1] <= 0) threads[1] = get_threads();
+
+	size_t queue_capacity = (settings.queue > 0) ? settings.queue : 2*threads[1];
+
+	pipeline_counters counters;
+
+	run_pipeline<batch_job>(input_files.size(), threads, queue_capacity,
+		// Decode
+		[&](int i, batch_job& job) {
+			job.index = i;
+
+			try {
+				PROFILE_SCOPE("load", 0);
+
+				// Decoded straight into the mapped output file, the encode stage then only has to let go of it
+				job.image.reset(new image_io(input_files[i].c_str(), output_files[i].c_str()));
+
+				PROFILE_PIXELS((Uint64) job.image->width()*job.image->height());
+			}
+			catch (const image_error& error) {
+				errors[i] = error.what();
+
+				return false;
+			}
+
+			return true;
+		},
+		// Transform
+		[&](batch_job& job) {
+			ostringstream out;
+
+			manip_image(options, *job.image, out);
+			outputs[job.index] = out.str();
+
+			return true;
+		},
+		// Encode
+		[&](batch_job& job) {
+			PROFILE_SCOPE("save", (Uint64) job.image->width()*job.image->height());
+
+			try {
+				job.image->write(output_files[job.index].c_str());
+			}
+			catch (const image_error& error) {
+				errors[job.index] = error.what();
+			}
+
+			// Unmapping the output is part of writing it
+			job.image.reset();
+		},
+		counters);
+
+	int failed = 0;
+
+	// Report in the order of the list, measurements under the name of their image
+	for (size_t i = 0; i < input_files.size(); i++) {
+		if (!outputs[i].empty()) cout << input_files[i] << ":\n" << outputs[i];
+
+		if (!errors[i].empty()) {
+			cout << input_files[i] << ": " << errors[i] << endl;
+			failed++;
+		}
+	}
+
+	if (failed) cout << failed << " of " << input_files.size() << " images failed\n";
+
+	if (settings.stats_flag) print_pipeline_stats(counters);
+
+	return failed ? 1 : 0;
+}
+
+// Print the time spent in each stage to stderr, or write it to profile_file as JSON
+static void print_profile(const string& profile_file) {
+#ifdef IMAGE_PROFILE
+	if (profile_file.empty()) profile_report(cerr);
+	else if (!profile_write_json(profile_file.c_str())) cerr << "Can't write the profile to " << profile_file << "\n";
+#else
+	(void) profile_file;
+#endif
+}
+
+int main(int argc, char** argv) {
+	manip_options options;
 
-	// Color mask flags
-	int c_flag = 0;
-	int c_r_flag = 0;
-	int c_g_flag = 0;
-	int c_b_flag = 0;
-	int c_mask = 0;
 	string c_args;
+	string s_args;
 
 	char* output_file = NULL;
 	char* input_file = NULL;
-	char c;
+	int c;
+
+	// Batch mode, a list of images or a whole directory goes to out_dir
+	string batch_file;
+	string in_dir;
+	string out_dir;
+	batch_settings settings;
+
+	// Rows per strip when streaming, 0 loads the whole image
+	int stream_rows = 0;
+
+	// Profile of the stages, printed after the run unless a JSON file is named
+	int profile_flag = 0;
+	int counters_flag = 0;
+	string profile_file;
+
+	static const option long_options[] = {
+		{"batch", required_argument, NULL, OPT_BATCH},
+		{"in-dir", required_argument, NULL, OPT_IN_DIR},
+		{"out-dir", required_argument, NULL, OPT_OUT_DIR},
+		{"stages", required_argument, NULL, OPT_STAGES},
+		{"queue", required_argument, NULL, OPT_QUEUE},
+		{"pipeline-stats", no_argument, NULL, OPT_PIPELINE_STATS},
+		{"stream", optional_argument, NULL, OPT_STREAM},
+		{"profile", optional_argument, NULL, OPT_PROFILE},
+		{"counters", no_argument, NULL, OPT_COUNTERS},
+		{NULL, 0, NULL, 0}
+	};
 
 	// If no command-line arguments are passed
 	if (argc < 2) {
 		printf("Usage: io_manip -f [INPUT]... -o [OUTPUT]... [OPTION]...\n");
+		printf("   or: io_manip --batch [LIST] --out-dir [DIR]... [OPTION]...\n");
+		printf("   or: io_manip --in-dir [DIR] --out-dir [DIR]... [OPTION]...\n");
 
 		return 1;
 	}
 
 	// Parse through all the arguments
-	while ((c = getopt(argc, argv, "f:o:t:d:r:glpamveis:hc:")) != -1) {
+	while ((c = getopt_long(argc, argv, "f:o:t:d:r:glpamveis:k:hc:j:", long_options, NULL)) != -1) {
 		switch (c) {
 			// Input file
 			case 'f':
@@ -89,84 +556,186 @@ int main(int argc, char** argv) {
 
 			// Threshold the image
 			case 't':
-				t_flag = 1;
-				t_value = atoi(optarg);
+				options.t_flag = 1;
+				// otsu picks the threshold from the histogram of the image
+				options.t_otsu_flag = (string(optarg) == "otsu");
+				options.t_value = atoi(optarg);
 				break;
 
 			// Dilate the image
 			case 'd':
-				d_flag = 1;
-				d_value = atoi(optarg);
+				options.d_flag = 1;
+				options.d_value = atoi(optarg);
 				break;
 
 			// Erode the image
 			case 'r':
-				r_flag = 1;
-				r_value = atoi(optarg);
+				options.r_flag = 1;
+				options.r_value = atoi(optarg);
 				break;
 
 			// Apply a Sobel gradient to the image
 			case 'g':
-				g_flag = 1;
+				options.g_flag = 1;
+
+				// Can be followed by l1 for |gx| + |gy| or orientation for the direction of the gradient instead of its magnitude
+				if (optind < argc) {
+					string g_args = argv[optind];
+
+					if (g_args == "l2" || g_args == "l1" || g_args == "orientation") {
+						options.g_output = (g_args == "l1") ? SOBEL_L1 : (g_args == "orientation") ? SOBEL_ORIENTATION : SOBEL_L2;
+						optind++;
+					}
+				}
 				break;
 
 			// Apply a Sobel gradient to the image
 			case 'l':
-				l_flag = 1;
+				options.l_flag = 1;
 				break;
 
 			// Compute the perimiter of the object
 			case 'p':
-				p_flag = 1;
+				options.p_flag = 1;
 				break;
 
 			// Compute the area of the object
 			case 'a':
-				a_flag = 1;
+				options.a_flag = 1;
 				break;
 
 			// Compute the moments of the object
 			case 'm':
-				m_flag = 1;
+				options.m_flag = 1;
 				break;
 
 			// Compute the moment invariants of the object
 			case 'v':
-				v_flag = 1;
+				options.v_flag = 1;
 				break;
 
 			// Compute the Eigen values and vectors
 			case 'e':
-				e_flag = 1;
+				options.e_flag = 1;
 				break;
 
 			// Invert the specified channels of the image
 			case 'i':
-				i_flag = 1;
+				options.i_flag = 1;
 				break;
 
 			// Smooth the image with mean algorithm
 			case 's':
 				s_args = optarg;
 				// Check the arguments for smoothing method
-				if (s_args.find("m") != s_args.npos) s_mean_flag = 1;
-				if (s_args.find("d") != s_args.npos) s_med_flag = 1;
+				// A method can be followed by :<radius>, e.g. m:5
+				for (size_t i = 0; i < s_args.size(); i++) {
+					int* radius = NULL;
+
+					if (s_args[i] == 'm') {
+						options.s_mean_flag = 1;
+						radius = &options.s_mean_radius;
+					}
+					if (s_args[i] == 'd') {
+						options.s_med_flag = 1;
+						radius = &options.s_med_radius;
+					}
+
+					if (radius && i + 1 < s_args.size() && s_args[i + 1] == ':') {
+						*radius = atoi(s_args.c_str() + i + 2);
+					}
+				}
+				break;
+
+			// Convolve the image with the kernel in a file
+			case 'k':
+				try {
+					options.k_kernel = conv_kernel::load(optarg);
+					options.k_flag = 1;
+				}
+				catch (const image_error& error) {
+					cout << error.what() << endl;
+
+					return 1;
+				}
 				break;
 
 			// Apply histogram equalization algorithm to the image
 			case 'h':
-				h_flag = 1;
+				options.h_flag = 1;
+
+				// Can be followed by adaptive:<tiles>:<clip> to equalize each tile of a grid separately
+				if (optind < argc && string(argv[optind]).compare(0, 8, "adaptive") == 0) {
+					string h_args = argv[optind++];
+					size_t tiles_pos = h_args.find(':');
+					size_t clip_pos = (tiles_pos == string::npos) ? string::npos : h_args.find(':', tiles_pos + 1);
+
+					options.h_adaptive_flag = 1;
+					if (tiles_pos != string::npos) options.h_tiles = atoi(h_args.c_str() + tiles_pos + 1);
+					if (clip_pos != string::npos) options.h_clip = atof(h_args.c_str() + clip_pos + 1);
+				}
+				break;
+
+			// Number of threads for the neighborhood transforms, 0 uses every core
+			case 'j':
+				set_threads(atoi(optarg));
 				break;
 
 			// Color mask
 			case 'c':
-				c_flag = 1;
+				options.c_flag = 1;
 				c_args = optarg;
 
 				// Check the arguments for RGB flags and set the color mask
-				if (c_args.find("r") != c_args.npos) c_r_flag = 1;
-				if (c_args.find("g") != c_args.npos) c_g_flag = 1;
-				if (c_args.find("b") != c_args.npos) c_b_flag = 1;
+				if (c_args.find("r") != c_args.npos) options.c_r_flag = 1;
+				if (c_args.find("g") != c_args.npos) options.c_g_flag = 1;
+				if (c_args.find("b") != c_args.npos) options.c_b_flag = 1;
+				break;
+
+			// Batch mode
+			case OPT_BATCH:
+				batch_file = optarg;
+				break;
+
+			case OPT_IN_DIR:
+				in_dir = optarg;
+				break;
+
+			case OPT_OUT_DIR:
+				out_dir = optarg;
+				break;
+
+			// Threads of the decode, transform and encode stages as <decode>:<transform>:<encode>
+			case OPT_STAGES:
+				sscanf(optarg, "%d:%d:%d", &settings.stages[0], &settings.stages[1], &settings.stages[2]);
+				break;
+
+			// Images each queue between the stages can hold
+			case OPT_QUEUE:
+				settings.queue = atoi(optarg);
+				break;
+
+			case OPT_PIPELINE_STATS:
+				settings.stats_flag = 1;
+				break;
+
+			// Stream the image through in strips of rows, --stream=<rows> sets their size
+			case OPT_STREAM:
+				stream_rows = optarg ? max(atoi(optarg), 1) : 256;
+				break;
+
+			// Time every stage, --profile <file> writes the results to a JSON file
+			case OPT_PROFILE:
+				profile_flag = 1;
+
+				if (optarg) profile_file = optarg;
+				else if (optind < argc && argv[optind][0] != '-') profile_file = argv[optind++];
+				break;
+
+			// Add hardware counters to the profile
+			case OPT_COUNTERS:
+				profile_flag = 1;
+				counters_flag = 1;
 				break;
 
 			// Error checking
@@ -178,8 +747,26 @@ int main(int argc, char** argv) {
 				else if (optopt == 'c') {
 					printf("Option -%c requires an argument.\nPass the flags 'r', 'g' or 'b' to mask off those color channels.\n", optopt);
 				}
+				else if (optopt == 'k') {
+					printf("Option -%c requires a kernel file as an argument.\n", optopt);
+				}
+				else if (optopt == 'j') {
+					printf("Option -%c requires the number of threads as an argument, 0 uses every core.\n", optopt);
+				}
 				else if (optopt == 's') {
-					printf("Option -%c requires an argument.\nPass the flags 'd' or 'm' to use a specific smoothing method.\n", optopt);
+					printf("Option -%c requires an argument.\nPass the flags 'd' or 'm' to use a specific smoothing method, 'm:<radius>' or 'd:<radius>' sets the size of the filter.\n", optopt);
+				}
+				else if (optopt == OPT_STAGES) {
+					printf("Option --stages requires the threads of each stage as an argument, e.g. 1:4:1.\n");
+				}
+				else if (optopt == OPT_QUEUE) {
+					printf("Option --queue requires the number of images each queue holds as an argument.\n");
+				}
+				else if (optopt >= OPT_BATCH) {
+					printf("Option %s requires a path as an argument.\n", argv[optind - 1]);
+				}
+				else if (optopt == 0) {
+					printf("Unknown option '%s'.\n", argv[optind - 1]);
 				}
 				else if (isprint(optopt)) {
 					printf("Unknown option '-%c'.\n", optopt);
@@ -192,6 +779,55 @@ int main(int argc, char** argv) {
 		}
 	}
 
+	if (profile_flag) {
+#ifdef IMAGE_PROFILE
+		string error;
+
+		if (counters_flag && !profile_start_counters(error)) {
+			cerr << "Hardware counters unavailable (" << error << "), profiling without them\n";
+		}
+
+		profile_start();
+#else
+		(void) counters_flag;
+
+		cerr << "Built without profiling, rebuild with PROFILE=1 to use --profile\n";
+#endif
+	}
+
+	// Initialize the SDL libraries once for every image
+	if (!batch_file.empty() || !in_dir.empty()) {
+		vector<string> input_files;
+
+		if (out_dir.empty()) {
+			cout << "Please specify an output directory!\n";
+
+			return 1;
+		}
+
+		if (!batch_file.empty() && !list_file(batch_file, input_files)) {
+			cout << "Can't read the list " << batch_file << "\n";
+
+			return 1;
+		}
+
+		if (!in_dir.empty() && !list_directory(in_dir, input_files)) {
+			cout << "Can't read the directory " << in_dir << "\n";
+
+			return 1;
+		}
+
+		SDL_Init(SDL_INIT_EVERYTHING);
+
+		int status = manip_batch(options, input_files, out_dir, settings);
+
+		if (profile_flag) print_profile(profile_file);
+
+		SDL_Quit();
+
+		return status;
+	}
+
 	// Check for input and output files
 	if (!input_file) {
 		cout << "Please specify an input file!\n";
@@ -208,89 +844,38 @@ int main(int argc, char** argv) {
 	// Initialize the SDL libraries
 	SDL_Init(SDL_INIT_EVERYTHING);
 
-	// Open the image
-	image_io image(input_file);
-
-	// Do the the operations specified by the command line switches
-	// Operations in roughly ascending order of destructiveness
-	// Compose the mask and mask off specified colors
-	c_mask = (c_r_flag*M_RED | c_g_flag*M_GREEN | c_b_flag*M_BLUE);
-	if (c_flag) color_mask(image, c_mask);
-	if (i_flag) invert(image);
-
-	if (s_mean_flag) smooth_mean(image);
-	if (s_med_flag) smooth_median(image);
-
-	if (h_flag) hist_eq(image);
-
-	if (t_flag) threshold(image, t_value);
-	if (d_flag) dilation(image, d_value);
-	if (r_flag) erosion(image, r_value);
-	if (p_flag) {
-		cout << "Perimiter is: " << perimiter(image) << endl;
-	}
-	if (a_flag) {
-		cout << "Area is: " << area(image) << endl;
-	}
-	if (m_flag || v_flag || e_flag) {
-		auto moment_results = moment(image);
-		auto centroid_results = centroid(moment_results);
-		auto central_moment_results = central_moments(moment_results, centroid_results);
-
-		if (m_flag) {
-			cout << "M00 is: " << moment_results[0][0] << endl;
-			cout << "M01 is: " << moment_results[0][1] << endl;
-			cout << "M02 is: " << moment_results[0][2] << endl;
-			cout << "M03 is: " << moment_results[0][3] << endl;
-			cout << "M10 is: " << moment_results[1][0] << endl;
-			cout << "M20 is: " << moment_results[2][0] << endl;
-			cout << "M30 is: " << moment_results[3][0] << endl;
-			cout << "M11 is: " << moment_results[1][1] << endl;
-			cout << "M12 is: " << moment_results[1][2] << endl;
-			cout << "M21 is: " << moment_results[2][1] << endl;
-
-			cout << "Centroid is: (" << centroid_results[0] << ", ";
-			cout << centroid_results[1] << ")" << endl;
-
-			cout << "U00 is: " << central_moment_results[0][0] << endl;
-			cout << "U02 is: " << central_moment_results[0][2] << endl;
-			cout << "U03 is: " << central_moment_results[0][3] << endl;
-			cout << "U20 is: " << central_moment_results[2][0] << endl;
-			cout << "U30 is: " << central_moment_results[3][0] << endl;
-			cout << "U11 is: " << central_moment_results[1][1] << endl;
-			cout << "U12 is: " << central_moment_results[1][2] << endl;
-			cout << "U21 is: " << central_moment_results[2][1] << endl;
+	try {
+		if (stream_rows) {
+			manip_stream(options, input_file, output_file, stream_rows, cout);
 		}
+		else {
+			unique_ptr<image_io> image;
 
-		if (v_flag) {
-			auto invariant_results = invariants(central_moment_results);
+			{
+				PROFILE_SCOPE("load", 0);
 
-			cout << "I0 is: " << invariant_results[0] << endl;
-			cout << "I1 is: " << invariant_results[1] << endl;
-			cout << "I2 is: " << invariant_results[2] << endl;
-			cout << "I3 is: " << invariant_results[3] << endl;
-			cout << "I4 is: " << invariant_results[4] << endl;
-			cout << "I5 is: " << invariant_results[5] << endl;
-			cout << "I6 is: " << invariant_results[6] << endl;
-		}
+				// Open the image, its pixels are kept in the output file where possible
+				image.reset(new image_io(input_file, output_file));
 
-		if (e_flag) {
-			auto eigen_results = eigen(moment_results, centroid_results);
+				PROFILE_PIXELS((Uint64) image->width()*image->height());
+			}
+
+			manip_image(options, *image, cout);
 
-			cout << "L1 is: " << eigen_results[0][0] << endl;
-			cout << "L2 is: " << eigen_results[1][0] << endl;
+			PROFILE_SCOPE("save", (Uint64) image->width()*image->height());
 
-			cout << "V1 is: (" << eigen_results[0][1] << ", " << eigen_results[0][2] << ")" << endl;
-			cout << "V2 is: (" << eigen_results[1][1] << ", " << eigen_results[1][2] << ")" << endl;
+			// Write to a new image file, unmapping it is part of writing it
+			image->write(output_file);
+			image.reset();
 		}
 	}
+	catch (const image_error& error) {
+		cout << error.what() << endl;
 
-	// Edge Detection
-	if (g_flag) sobel_gradient(image);
-	if (l_flag) laplacian(image);
+		return 1;
+	}
 
-	// Write to a new image file
-	image.write(output_file);
+	if (profile_flag) print_profile(profile_file);
 
 	// Cleans up and closes the SDL libraries
 	SDL_Quit();
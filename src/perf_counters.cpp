@@ -0,0 +1,138 @@
+#include "perf_counters.h"
+
+#include <algorithm>
+
+
+using namespace std;
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+static const Uint64 event_configs[PERF_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static int current_tid() {
+	return syscall(SYS_gettid);
+}
+
+static int open_event(int tid, Uint64 config, int leader) {
+	perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	// User space only, which is also all that perf_event_paranoid 2 allows
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, tid, -1, leader, 0);
+}
+
+perf_counters::perf_counters() : m_running(false) {}
+
+perf_counters::~perf_counters() {
+	for (size_t i = 0; i < m_fds.size(); i++) close(m_fds[i]);
+}
+
+bool perf_counters::open_thread(int tid) {
+	int fds[PERF_EVENTS];
+
+	for (int e = 0; e < PERF_EVENTS; e++) {
+		fds[e] = open_event(tid, event_configs[e], e ? fds[0] : -1);
+
+		if (fds[e] < 0) {
+			m_error = strerror(errno);
+
+			while (e--) close(fds[e]);
+
+			return false;
+		}
+	}
+
+	m_leaders.push_back(fds[0]);
+	m_fds.insert(m_fds.end(), fds, fds + PERF_EVENTS);
+	m_threads.push_back(tid);
+
+	return true;
+}
+
+bool perf_counters::start() {
+	if (m_running) return true;
+
+	// Whether the calling thread can be counted decides whether there are counters at all
+	if (!open_thread(current_tid())) return false;
+
+	// The other threads, like the workers of the thread pool, are counted where the kernel lets us
+	if (DIR* tasks = opendir("/proc/self/task")) {
+		while (dirent* entry = readdir(tasks)) {
+			int tid = atoi(entry->d_name);
+
+			if (tid > 0 && find(m_threads.begin(), m_threads.end(), tid) == m_threads.end()) open_thread(tid);
+		}
+
+		closedir(tasks);
+	}
+
+	m_running = true;
+
+	return true;
+}
+
+void perf_counters::add_thread() {
+	int tid = current_tid();
+
+	if (m_running && find(m_threads.begin(), m_threads.end(), tid) == m_threads.end()) open_thread(tid);
+}
+
+void perf_counters::read(Uint64 counts[PERF_EVENTS]) {
+	fill(counts, counts + PERF_EVENTS, 0);
+
+	for (size_t i = 0; i < m_leaders.size(); i++) {
+		// Number of counters, time enabled, time running and then the counts
+		Uint64 values[3 + PERF_EVENTS];
+
+		if (::read(m_leaders[i], values, sizeof(values)) != (ssize_t) sizeof(values) || values[2] == 0) continue;
+
+		double scale = (double) values[1]/values[2];
+
+		for (int e = 0; e < PERF_EVENTS; e++) counts[e] += values[3 + e]*scale;
+	}
+}
+
+#else
+
+perf_counters::perf_counters() : m_running(false) {}
+
+perf_counters::~perf_counters() {}
+
+bool perf_counters::open_thread(int) {
+	return false;
+}
+
+bool perf_counters::start() {
+	m_error = "perf_event counters need Linux";
+
+	return false;
+}
+
+void perf_counters::add_thread() {}
+
+void perf_counters::read(Uint64 counts[PERF_EVENTS]) {
+	fill(counts, counts + PERF_EVENTS, 0);
+}
+
+#endif
@@ -0,0 +1,311 @@
+#include "point_ops.h"
+
+#include "histogram.h"
+#include "profile.h"
+#include "simd.h"
+#include "transforms.h"
+
+#include <cstring>
+#include <vector>
+
+
+using namespace std;
+
+point_ops::point_ops() {
+	clear();
+}
+
+// Reset to the identity transform
+void point_ops::clear() {
+	for (int c = 0; c < 3; c++) {
+		for (int i = 0; i <= 255; i++) {
+			m_pre[c][i] = i;
+			m_post[c][i] = i;
+		}
+	}
+
+	m_gray = false;
+	m_empty = true;
+}
+
+void point_ops::add_color_mask(int c_mask) {
+	// If all colors are masked, display in grayscale
+	if (c_mask == (M_RED | M_GREEN | M_BLUE)) {
+		array<Uint8, 256> lut;
+
+		for (int i = 0; i <= 255; i++) lut[i] = i;
+
+		compose_gray(lut);
+
+		return;
+	}
+
+	array<array<Uint8, 256>, 3> lut;
+
+	// Strip colors depending on c_mask
+	for (int i = 0; i <= 255; i++) {
+		lut[0][i] = ((c_mask & M_RED) != M_RED) ? i : 0;
+		lut[1][i] = ((c_mask & M_GREEN) != M_GREEN) ? i : 0;
+		lut[2][i] = ((c_mask & M_BLUE) != M_BLUE) ? i : 0;
+	}
+
+	compose_channels(lut);
+}
+
+void point_ops::add_invert() {
+	array<array<Uint8, 256>, 3> lut;
+
+	for (int i = 0; i <= 255; i++) {
+		lut[0][i] = lut[1][i] = lut[2][i] = 255 - i;
+	}
+
+	compose_channels(lut);
+}
+
+// All pixels equal to or greater than the threshold will be turned white, all pixels below will be black
+void point_ops::add_threshold(Uint32 threshold) {
+	array<Uint8, 256> lut;
+
+	for (Uint32 i = 0; i <= 255; i++) {
+		lut[i] = (i >= threshold)?0xFF:0x00;
+	}
+
+	compose_gray(lut);
+}
+
+void point_ops::add_lut(const array<array<Uint8, 256>, 3>& lut) {
+	compose_channels(lut);
+}
+
+void point_ops::add_hist_eq(image_io& image_src) {
+	compose_channels(histogram(image_src, *this).equalization());
+}
+
+void point_ops::add_otsu_threshold(image_io& image_src) {
+	add_threshold(histogram(image_src, *this).otsu_threshold());
+}
+
+Uint32 point_ops::map(Uint32 pixel) const {
+	Uint32 pixel_pre = pack_RGB(m_pre[0][RGB_to_red(pixel)],
+								m_pre[1][RGB_to_green(pixel)],
+								m_pre[2][RGB_to_blue(pixel)]);
+
+	if (!m_gray) return pixel_pre;
+
+	Uint8 gray_value = RGB_to_gray(pixel_pre);
+
+	return pack_RGB(m_post[0][gray_value], m_post[1][gray_value], m_post[2][gray_value]);
+}
+
+void point_ops::apply(image_io& image_src) {
+	if (m_empty) return;
+
+	PROFILE_SCOPE("point_ops", (Uint64) image_src.width()*image_src.height());
+
+	locker lock(image_src);
+
+	Uint32 and_mask, xor_mask;
+	bool bitwise = bitwise_form(and_mask, xor_mask);
+
+	Uint32 threshold = 256;
+	bool gray_copy = m_gray && copy_form();
+	bool gray_threshold = m_gray && threshold_form(threshold);
+
+	vector<Uint8> gray_row(image_src.width());
+
+	array<Uint32, 3*256> pre_packed;
+	array<Uint32, 256> post_packed;
+	pack_tables(pre_packed, post_packed);
+
+	// Iterate through every row in memory order
+	for (int y = 0; y < image_src.height(); y++) {
+		Uint32* row = image_src.row(y);
+
+		if (!bitwise) {
+			simd_lut_row(row, image_src.width(), pre_packed.data());
+
+			// The channel tables are already applied
+			and_mask = 0xFFFFFFFF;
+			xor_mask = 0;
+		}
+
+		if (!m_gray) {
+			// Masking and inverting reduce to bit operations on the whole pixel
+			if (bitwise) simd_bitwise_row(row, image_src.width(), and_mask, xor_mask);
+		}
+		else if (gray_copy) {
+			simd_gray_replicate_row(row, image_src.width(), and_mask, xor_mask);
+		}
+		else if (gray_threshold) {
+			simd_threshold_row(row, image_src.width(), and_mask, xor_mask, threshold);
+		}
+		else {
+			if (bitwise) simd_bitwise_row(row, image_src.width(), and_mask, xor_mask);
+
+			simd_gray_row(row, gray_row.data(), image_src.width());
+
+			for (int x = 0; x < image_src.width(); x++) {
+				row[x] = post_packed[gray_row[x]];
+			}
+		}
+	}
+
+	image_src.invalidate_gray();
+
+	clear();
+}
+
+void point_ops::apply(image_io& image_src, binary_image& binary_dst) {
+	PROFILE_SCOPE("point_ops", (Uint64) image_src.width()*image_src.height());
+
+	locker lock(image_src);
+
+	Uint32 and_mask, xor_mask;
+	bool bitwise = bitwise_form(and_mask, xor_mask);
+
+	// Anything but a threshold leaves only the pixels with a gray value of 0 black
+	Uint32 threshold = 1;
+	bool gray_threshold = m_gray && threshold_form(threshold);
+
+	vector<Uint32> row_mapped(image_src.width());
+	vector<Uint8> gray_row(image_src.width());
+
+	array<Uint32, 3*256> pre_packed;
+	array<Uint32, 256> post_packed;
+	pack_tables(pre_packed, post_packed);
+
+	// A plain threshold compares the gray values the image already has
+	bool plain_threshold = gray_threshold && bitwise && and_mask == 0xFFFFFFFF && xor_mask == 0;
+
+	for (int y = 0; y < image_src.height(); y++) {
+		if (plain_threshold) {
+			binary_dst.threshold_row(y, image_src.gray_row(y), threshold);
+
+			continue;
+		}
+
+		const Uint32* row = image_src.row(y);
+
+		// Apply the channel tables or bit operations into a row buffer
+		if (gray_threshold && bitwise) {
+			if (and_mask != 0xFFFFFFFF || xor_mask != 0) {
+				memcpy(row_mapped.data(), row, image_src.width()*sizeof(Uint32));
+				simd_bitwise_row(row_mapped.data(), image_src.width(), and_mask, xor_mask);
+
+				row = row_mapped.data();
+			}
+		}
+		else if (gray_threshold) {
+			memcpy(row_mapped.data(), row, image_src.width()*sizeof(Uint32));
+			simd_lut_row(row_mapped.data(), image_src.width(), pre_packed.data());
+
+			row = row_mapped.data();
+		}
+		else {
+			for (int x = 0; x < image_src.width(); x++) {
+				row_mapped[x] = map(row[x]);
+			}
+
+			row = row_mapped.data();
+		}
+
+		// The threshold compares the gray value of the pixels before the gray tables
+		simd_gray_row(row, gray_row.data(), image_src.width());
+		binary_dst.threshold_row(y, gray_row.data(), threshold);
+	}
+
+	clear();
+}
+
+// Expand the tables into whole pixels, each channel table entry shifted into place so the channels combine with an OR
+void point_ops::pack_tables(array<Uint32, 3*256>& pre_packed, array<Uint32, 256>& post_packed) const {
+	for (int i = 0; i <= 255; i++) {
+		pre_packed[i] = pack_RGB(m_pre[0][i], 0, 0);
+		pre_packed[256 + i] = pack_RGB(0, m_pre[1][i], 0);
+		pre_packed[512 + i] = pack_RGB(0, 0, m_pre[2][i]);
+
+		post_packed[i] = pack_RGB(m_post[0][i], m_post[1][i], m_post[2][i]);
+	}
+}
+
+// Check if the gray tables copy the gray value into every channel
+bool point_ops::copy_form() const {
+	for (int c = 0; c < 3; c++) {
+		for (int i = 0; i <= 255; i++) {
+			if (m_post[c][i] != i) return false;
+		}
+	}
+
+	return true;
+}
+
+// Check if the gray tables turn every channel white at or above a threshold and black below
+bool point_ops::threshold_form(Uint32& threshold) const {
+	threshold = 256;
+
+	for (int i = 0; i <= 255; i++) {
+		if (m_post[0][i] == 0xFF) {
+			threshold = i;
+
+			break;
+		}
+	}
+
+	for (int c = 0; c < 3; c++) {
+		for (Uint32 i = 0; i <= 255; i++) {
+			if (m_post[c][i] != ((i >= threshold)?0xFF:0x00)) return false;
+		}
+	}
+
+	return true;
+}
+
+// Check if every channel table is the identity, zero, inversion or all ones
+// If so the tables reduce to pixel = (pixel & and_mask) ^ xor_mask
+bool point_ops::bitwise_form(Uint32& and_mask, Uint32& xor_mask) const {
+	and_mask = xor_mask = 0;
+
+	for (int c = 0; c < 3; c++) {
+		Uint8 and_value = m_pre[c][0] ^ m_pre[c][255];
+		Uint8 xor_value = m_pre[c][0];
+
+		for (int i = 0; i <= 255; i++) {
+			if (m_pre[c][i] != ((i & and_value) ^ xor_value)) return false;
+		}
+
+		and_mask |= ((Uint32) and_value) << 8*c;
+		xor_mask |= ((Uint32) xor_value) << 8*c;
+	}
+
+	return true;
+}
+
+void point_ops::compose_channels(const array<array<Uint8, 256>, 3>& lut) {
+	// Before the channels are mixed the new table follows the per-channel table
+	// Afterwards it follows the gray value table
+	array<array<Uint8, 256>, 3>& table = m_gray ? m_post : m_pre;
+
+	for (int c = 0; c < 3; c++) {
+		for (int i = 0; i <= 255; i++) {
+			table[c][i] = lut[c][table[c][i]];
+		}
+	}
+
+	m_empty = false;
+}
+
+void point_ops::compose_gray(const array<Uint8, 256>& lut) {
+	for (int i = 0; i <= 255; i++) {
+		// Gray value of the pixel the queued operations produce from gray level i
+		Uint8 gray_value = i;
+
+		if (m_gray) {
+			gray_value = RGB_to_gray(pack_RGB(m_post[0][i], m_post[1][i], m_post[2][i]));
+		}
+
+		m_post[0][i] = m_post[1][i] = m_post[2][i] = lut[gray_value];
+	}
+
+	m_gray = true;
+	m_empty = false;
+}
@@ -0,0 +1,301 @@
+#include "profile.h"
+
+#ifdef IMAGE_PROFILE
+
+#include <time.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+
+using namespace std;
+
+// Totals of every run of a scope at one place in the nesting
+struct profile_stage {
+	string name;
+	int parent;
+	int depth;
+
+	Uint64 calls;
+	double wall;
+	double cpu;
+	Uint64 bytes;
+	Uint64 pixels;
+	Uint64 events[PERF_EVENTS];
+};
+
+// Both are constant initialized, operator new can count before anything else has been constructed
+static atomic<bool> enabled(false);
+static atomic<Uint64> allocated(0);
+
+static mutex& stages_mutex() {
+	static mutex stages_lock;
+
+	return stages_lock;
+}
+
+static perf_counters& counters() {
+	static perf_counters instance;
+
+	return instance;
+}
+
+static vector<profile_stage>& stages() {
+	static vector<profile_stage> stage_list;
+
+	return stage_list;
+}
+
+// Stage the calling thread is inside, -1 outside of any
+static int& current_stage() {
+	static thread_local int stage = -1;
+
+	return stage;
+}
+
+static double wall_seconds() {
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double cpu_seconds() {
+	timespec time;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+
+	return time.tv_sec + time.tv_nsec*1e-9;
+}
+
+void profile_start() {
+	enabled = true;
+}
+
+bool profile_enabled() {
+	return enabled;
+}
+
+bool profile_start_counters(string& error) {
+	lock_guard<mutex> lock(stages_mutex());
+
+	if (!counters().start()) {
+		error = counters().error();
+
+		return false;
+	}
+
+	return true;
+}
+
+void profile_alloc(Uint64 bytes) {
+	if (enabled.load(memory_order_relaxed)) allocated.fetch_add(bytes, memory_order_relaxed);
+}
+
+void profile_pixels(Uint64 pixels) {
+	if (!enabled.load(memory_order_relaxed) || current_stage() < 0) return;
+
+	lock_guard<mutex> lock(stages_mutex());
+
+	stages()[current_stage()].pixels += pixels;
+}
+
+profile_scope::profile_scope(const char* name, Uint64 pixels) : m_stage(-1), m_parent(-1), m_wall(0), m_cpu(0), m_bytes(0), m_events() {
+	if (!enabled.load(memory_order_relaxed)) return;
+
+	m_parent = current_stage();
+
+	{
+		lock_guard<mutex> lock(stages_mutex());
+		vector<profile_stage>& stage_list = stages();
+
+		for (size_t i = 0; i < stage_list.size() && m_stage < 0; i++) {
+			if (stage_list[i].parent == m_parent && stage_list[i].name == name) m_stage = i;
+		}
+
+		if (m_stage < 0) {
+			int depth = (m_parent < 0) ? 0 : stage_list[m_parent].depth + 1;
+
+			stage_list.push_back(profile_stage{name, m_parent, depth, 0, 0, 0, 0, 0, {}});
+			m_stage = stage_list.size() - 1;
+		}
+
+		stage_list[m_stage].calls++;
+		stage_list[m_stage].pixels += pixels;
+
+		if (counters().running()) {
+			counters().add_thread();
+			counters().read(m_events);
+		}
+	}
+
+	current_stage() = m_stage;
+
+	m_bytes = allocated.load(memory_order_relaxed);
+	m_cpu = cpu_seconds();
+	m_wall = wall_seconds();
+}
+
+profile_scope::~profile_scope() {
+	if (m_stage < 0) return;
+
+	double wall = wall_seconds() - m_wall;
+	double cpu = cpu_seconds() - m_cpu;
+	Uint64 bytes = allocated.load(memory_order_relaxed) - m_bytes;
+
+	current_stage() = m_parent;
+
+	lock_guard<mutex> lock(stages_mutex());
+	profile_stage& stage = stages()[m_stage];
+
+	stage.wall += wall;
+	stage.cpu += cpu;
+	stage.bytes += bytes;
+
+	if (counters().running()) {
+		Uint64 events[PERF_EVENTS];
+
+		counters().read(events);
+
+		for (int e = 0; e < PERF_EVENTS; e++) stage.events[e] += events[e] - m_events[e];
+	}
+}
+
+// Millions of pixels per second of wall time
+static double throughput(const profile_stage& stage) {
+	return (stage.wall > 0) ? stage.pixels/stage.wall/1e6 : 0;
+}
+
+// Instructions per cycle
+static double ipc(const profile_stage& stage) {
+	return stage.events[PERF_CYCLES] ? (double) stage.events[PERF_INSTRUCTIONS]/stage.events[PERF_CYCLES] : 0;
+}
+
+static double per_pixel(const profile_stage& stage, perf_event event) {
+	return stage.pixels ? (double) stage.events[event]/stage.pixels : 0;
+}
+
+// Children come right after their parent, in the order they first ran
+static void stage_order(const vector<profile_stage>& stage_list, int parent, vector<int>& order) {
+	for (size_t i = 0; i < stage_list.size(); i++) {
+		if (stage_list[i].parent != parent) continue;
+
+		order.push_back(i);
+		stage_order(stage_list, i, order);
+	}
+}
+
+void profile_report(ostream& out) {
+	lock_guard<mutex> lock(stages_mutex());
+	const vector<profile_stage>& stage_list = stages();
+
+	vector<int> order;
+	stage_order(stage_list, -1, order);
+
+	ios::fmtflags flags = out.flags();
+
+	bool events = counters().running();
+
+	out << left << setw(28) << "Stage" << right
+		<< setw(8) << "Calls" << setw(12) << "Wall ms" << setw(12) << "CPU ms"
+		<< setw(12) << "Alloc MB" << setw(12) << "MPixels" << setw(10) << "MP/s";
+
+	if (events) out << setw(8) << "IPC" << setw(12) << "Cycles/px" << setw(14) << "Cache miss/px" << setw(15) << "Branch miss/px";
+
+	out << "\n";
+
+	out << fixed;
+
+	for (int i : order) {
+		const profile_stage& stage = stage_list[i];
+
+		out << left << setw(28) << (string(2*stage.depth, ' ') + stage.name) << right
+			<< setw(8) << stage.calls
+			<< setw(12) << setprecision(2) << 1e3*stage.wall
+			<< setw(12) << setprecision(2) << 1e3*stage.cpu
+			<< setw(12) << setprecision(2) << stage.bytes/1e6
+			<< setw(12) << setprecision(3) << stage.pixels/1e6
+			<< setw(10) << setprecision(1) << throughput(stage);
+
+		if (events) {
+			out << setw(8) << setprecision(2) << ipc(stage)
+				<< setw(12) << setprecision(2) << per_pixel(stage, PERF_CYCLES)
+				<< setw(14) << setprecision(4) << per_pixel(stage, PERF_CACHE_MISSES)
+				<< setw(15) << setprecision(4) << per_pixel(stage, PERF_BRANCH_MISSES);
+		}
+
+		out << "\n";
+	}
+
+	out.flags(flags);
+}
+
+bool profile_write_json(const char* filename) {
+	ofstream out(filename);
+
+	if (!out) return false;
+
+	lock_guard<mutex> lock(stages_mutex());
+	const vector<profile_stage>& stage_list = stages();
+
+	vector<int> order;
+	stage_order(stage_list, -1, order);
+
+	out << "{\n  \"stages\": [";
+
+	for (size_t n = 0; n < order.size(); n++) {
+		const profile_stage& stage = stage_list[order[n]];
+
+		// The path names the stage together with the ones it ran inside
+		string path = stage.name;
+
+		for (int parent = stage.parent; parent >= 0; parent = stage_list[parent].parent) path = stage_list[parent].name + "/" + path;
+
+		out << (n ? ",\n" : "\n")
+			<< "    {\"name\": \"" << stage.name << "\", \"path\": \"" << path << "\", \"depth\": " << stage.depth
+			<< ", \"calls\": " << stage.calls
+			<< ", \"wall_ms\": " << 1e3*stage.wall
+			<< ", \"cpu_ms\": " << 1e3*stage.cpu
+			<< ", \"bytes_allocated\": " << stage.bytes
+			<< ", \"pixels\": " << stage.pixels
+			<< ", \"mpixels_per_s\": " << throughput(stage);
+
+		if (counters().running()) {
+			out << ", \"cycles\": " << stage.events[PERF_CYCLES]
+				<< ", \"instructions\": " << stage.events[PERF_INSTRUCTIONS]
+				<< ", \"cache_misses\": " << stage.events[PERF_CACHE_MISSES]
+				<< ", \"branch_misses\": " << stage.events[PERF_BRANCH_MISSES]
+				<< ", \"ipc\": " << ipc(stage)
+				<< ", \"cycles_per_pixel\": " << per_pixel(stage, PERF_CYCLES)
+				<< ", \"cache_misses_per_pixel\": " << per_pixel(stage, PERF_CACHE_MISSES)
+				<< ", \"branch_misses_per_pixel\": " << per_pixel(stage, PERF_BRANCH_MISSES);
+		}
+
+		out << "}";
+	}
+
+	out << "\n  ]\n}\n";
+
+	return (bool) out;
+}
+
+// Count every allocation while profiling
+// The array forms and the nothrow forms all end up here
+void* operator new(size_t size) {
+	if (enabled.load(memory_order_relaxed)) allocated.fetch_add(size, memory_order_relaxed);
+
+	void* memory = malloc(size ? size : 1);
+
+	if (!memory) throw bad_alloc();
+
+	return memory;
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+#endif
@@ -0,0 +1,339 @@
+#include "raw_file.h"
+
+#include "transforms.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+
+using namespace std;
+
+// Where the pixels of the BMPs written start, past the headers and masks and aligned for the rows of Uint32
+#define BMP_DATA 128
+
+mapped_file::mapped_file(const char* filename) : m_data(NULL), m_size(0) {
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0) throw image_error(string("Can't open ") + filename + ": " + strerror(errno));
+
+	struct stat info;
+
+	if (fstat(fd, &info) < 0) {
+		close(fd);
+
+		throw image_error(string("Can't read ") + filename + ": " + strerror(errno));
+	}
+
+	m_size = info.st_size;
+
+	// Private so an image wrapped around the pixels can be changed without touching the file
+	map(fd, MAP_PRIVATE);
+}
+
+mapped_file::mapped_file(const char* filename, size_t size) : m_data(NULL), m_size(size) {
+	int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) throw image_error(string("Can't open ") + filename + " for writing: " + strerror(errno));
+
+	// Lay the whole file out up front, the pages are then filled in as the memory is written
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+
+		throw image_error(string("Can't write ") + filename + ": " + strerror(errno));
+	}
+
+	map(fd, MAP_SHARED);
+}
+
+mapped_file::~mapped_file() {
+	if (m_data) munmap(m_data, m_size);
+}
+
+// The mapping holds its own reference to the file, the descriptor isn't needed past this
+void mapped_file::map(int fd, int flags) {
+	if (m_size > 0) {
+		void* data = mmap(NULL, m_size, PROT_READ | PROT_WRITE, flags, fd, 0);
+
+		if (data == MAP_FAILED) {
+			close(fd);
+
+			throw image_error(string("mmap: ") + strerror(errno));
+		}
+
+		m_data = (Uint8*) data;
+	}
+
+	close(fd);
+}
+
+bool same_file(const char* name_a, const char* name_b) {
+	struct stat info_a, info_b;
+
+	if (stat(name_a, &info_a) < 0 || stat(name_b, &info_b) < 0) return false;
+
+	return info_a.st_dev == info_b.st_dev && info_a.st_ino == info_b.st_ino;
+}
+
+raw_format raw_format_for(const char* filename) {
+	string name = filename;
+	string extension = name.substr(name.find_last_of('.') + 1);
+
+	for (size_t i = 0; i < extension.size(); i++) extension[i] = tolower(extension[i]);
+
+	if (name.find('.') != string::npos && extension == "ppm") return RAW_PPM;
+	if (name.find('.') != string::npos && extension == "pgm") return RAW_PGM;
+
+	return RAW_BMP;
+}
+
+// Little-endian fields of a BMP header
+static Uint32 read_le32(const Uint8* bytes) {
+	return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((Uint32) bytes[3] << 24);
+}
+
+static Uint16 read_le16(const Uint8* bytes) {
+	return bytes[0] | (bytes[1] << 8);
+}
+
+static void write_le32(Uint8* bytes, Uint32 value) {
+	for (int i = 0; i < 4; i++) bytes[i] = (value >> 8*i) & 0xFF;
+}
+
+static void write_le16(Uint8* bytes, Uint16 value) {
+	for (int i = 0; i < 2; i++) bytes[i] = (value >> 8*i) & 0xFF;
+}
+
+raw_layout::raw_layout()
+	: m_format(RAW_BMP), m_width(0), m_height(0), m_bytes(0), m_bottom_up(false), m_red_first(false), m_packed(false),
+	m_data(0), m_stride(0) {}
+
+raw_layout::raw_layout(raw_format format, int width, int height)
+	: m_format(format), m_width(width), m_height(height), m_bottom_up(false), m_red_first(false), m_packed(false) {
+	if (format == RAW_BMP) {
+		m_bytes = 4;
+		m_red_first = true;
+		m_packed = true;
+		m_data = BMP_DATA;
+	}
+	else {
+		m_bytes = (format == RAW_PPM) ? 3 : 1;
+		m_data = snprintf(NULL, 0, "P%c\n%d %d\n255\n", (format == RAW_PPM) ? '6' : '5', width, height);
+	}
+
+	m_stride = (size_t) m_bytes*width;
+}
+
+bool raw_layout::parse(const Uint8* file, size_t size) {
+	if (size < 2) return false;
+
+	if (file[0] == 'B' && file[1] == 'M') return parse_bmp(file, size);
+	if (file[0] == 'P' && (file[1] == '6' || file[1] == '5')) return parse_pnm(file, size);
+
+	return false;
+}
+
+bool raw_layout::parse_bmp(const Uint8* file, size_t size) {
+	if (size < 18) throw image_error("Truncated BMP header");
+
+	Uint32 info_size = read_le32(file + 14);
+
+	// OS/2 and other short info headers are left to SDL_image
+	if (info_size < 40) return false;
+
+	// File header and the fields of the info header every version shares
+	if (size < 54) throw image_error("Truncated BMP header");
+
+	Sint32 height = (Sint32) read_le32(file + 22);
+	Uint16 bits = read_le16(file + 28);
+	Uint32 compression = read_le32(file + 30);
+	Uint32 colors = read_le32(file + 46);
+
+	m_format = RAW_BMP;
+	m_data = read_le32(file + 10);
+	m_width = (Sint32) read_le32(file + 18);
+	m_height = (height < 0) ? -height : height;
+	m_bottom_up = height > 0;
+	m_bytes = bits/8;
+	m_stride = ((size_t) bits*m_width + 31)/32*4;
+
+	if (m_width < 1 || m_height < 1) throw image_error("Unsupported BMP header");
+
+	// The channel masks follow the 40 byte info header, or are part of the longer ones
+	Uint32 red_mask = (size >= 66) ? read_le32(file + 54) : 0;
+	Uint32 green_mask = (size >= 66) ? read_le32(file + 58) : 0;
+	Uint32 blue_mask = (size >= 66) ? read_le32(file + 62) : 0;
+
+	// Uncompressed, or 32-bit with the masks of either byte order
+	bool bgr_masks = red_mask == 0x00FF0000 && green_mask == 0x0000FF00 && blue_mask == 0x000000FF;
+	bool rgb_masks = red_mask == 0x000000FF && green_mask == 0x0000FF00 && blue_mask == 0x00FF0000;
+
+	bool plain = (compression == 0 && (bits == 8 || bits == 24 || bits == 32))
+				|| (compression == 3 && bits == 32 && (bgr_masks || rgb_masks));
+
+	// 1, 4 and 16-bit, RLE and other masks are left to SDL_image
+	if (!plain) return false;
+
+	if (m_data + m_stride*m_height > size) throw image_error("Truncated BMP image data");
+
+	// Rows can be used as they are when they're in order, aligned and in the channel order of image_io
+	m_red_first = compression == 3 && rgb_masks;
+	m_packed = m_red_first && !m_bottom_up && m_data % 4 == 0;
+
+	if (bits == 8) {
+		size_t count = (colors == 0 || colors > 256) ? 256 : colors;
+
+		if (14 + info_size + 4*count > size) throw image_error("Truncated BMP palette");
+
+		const Uint8* entries = file + 14 + info_size;
+
+		m_palette.assign(256, 0);
+
+		for (size_t i = 0; i < count; i++) {
+			m_palette[i] = pack_RGB(entries[4*i + 2], entries[4*i + 1], entries[4*i]);
+		}
+	}
+	else {
+		m_palette.clear();
+	}
+
+	return true;
+}
+
+bool raw_layout::parse_pnm(const Uint8* file, size_t size) {
+	size_t position = 2;
+
+	// Next number of the header, skipping whitespace and comments
+	auto number = [&]() {
+		while (position < size && (isspace(file[position]) || file[position] == '#')) {
+			if (file[position] == '#') {
+				while (position < size && file[position] != '\n') position++;
+			}
+			else {
+				position++;
+			}
+		}
+
+		if (position >= size || !isdigit(file[position])) throw image_error("Malformed PPM/PGM header");
+
+		long value = 0;
+
+		for (; position < size && isdigit(file[position]) && value < (1L << 30); position++) value = 10*value + (file[position] - '0');
+
+		return (int) value;
+	};
+
+	m_format = (file[1] == '6') ? RAW_PPM : RAW_PGM;
+	m_width = number();
+	m_height = number();
+	int max_value = number();
+
+	if (m_width < 1 || m_height < 1 || max_value < 1) throw image_error("Malformed PPM/PGM header");
+
+	// 16-bit samples are left to SDL_image
+	if (max_value > 255) return false;
+
+	// A single whitespace character separates the header from the pixels
+	m_data = position + 1;
+	m_bytes = (m_format == RAW_PPM) ? 3 : 1;
+	m_stride = (size_t) m_bytes*m_width;
+	m_bottom_up = false;
+	m_red_first = false;
+	m_packed = false;
+	m_palette.clear();
+
+	if (m_data + m_stride*m_height > size) throw image_error("Truncated PPM/PGM image data");
+
+	return true;
+}
+
+const Uint8* raw_layout::row(const Uint8* file, int y) const {
+	return file + m_data + (size_t) (m_bottom_up ? m_height - 1 - y : y)*m_stride;
+}
+
+Uint8* raw_layout::row(Uint8* file, int y) const {
+	return file + m_data + (size_t) (m_bottom_up ? m_height - 1 - y : y)*m_stride;
+}
+
+void raw_layout::read_row(const Uint8* file, int y, Uint32* dst) const {
+	const Uint8* bytes = row(file, y);
+
+	if (m_format != RAW_BMP) {
+		if (m_bytes == 1) {
+			for (int x = 0; x < m_width; x++) dst[x] = pack_RGB(bytes[x], bytes[x], bytes[x]);
+		}
+		else {
+			for (int x = 0; x < m_width; x++, bytes += 3) dst[x] = pack_RGB(bytes[0], bytes[1], bytes[2]);
+		}
+	}
+	else if (m_bytes == 1) {
+		for (int x = 0; x < m_width; x++) dst[x] = m_palette[bytes[x]];
+	}
+	else if (m_red_first) {
+		// Already red first, only the unused byte has to go
+		for (int x = 0; x < m_width; x++, bytes += 4) dst[x] = pack_RGB(bytes[0], bytes[1], bytes[2]);
+	}
+	else {
+		// Blue, green, red and, for 32-bit, an unused byte
+		for (int x = 0; x < m_width; x++, bytes += m_bytes) dst[x] = pack_RGB(bytes[2], bytes[1], bytes[0]);
+	}
+}
+
+void raw_layout::write_header(Uint8* file) const {
+	if (m_format != RAW_BMP) {
+		// snprintf needs room for the terminator, which would land on the first pixel
+		vector<char> header(m_data + 1);
+
+		snprintf(header.data(), header.size(), "P%c\n%d %d\n255\n", (m_format == RAW_PPM) ? '6' : '5', m_width, m_height);
+		memcpy(file, header.data(), m_data);
+
+		return;
+	}
+
+	memset(file, 0, m_data);
+
+	Uint32 image_size = m_stride*m_height;
+
+	// File header
+	file[0] = 'B';
+	file[1] = 'M';
+	write_le32(file + 2, m_data + image_size);
+	write_le32(file + 10, m_data);
+
+	// Info header, a top down 32-bit image with bit field masks
+	write_le32(file + 14, 40);
+	write_le32(file + 18, m_width);
+	write_le32(file + 22, -m_height);
+	write_le16(file + 26, 1);
+	write_le16(file + 28, 32);
+	write_le32(file + 30, 3);
+	write_le32(file + 34, image_size);
+
+	// Masks of the packed format of image_io
+	write_le32(file + 54, 0x000000FF);
+	write_le32(file + 58, 0x0000FF00);
+	write_le32(file + 62, 0x00FF0000);
+}
+
+void raw_layout::write_row(Uint8* file, int y, const Uint32* src) const {
+	Uint8* bytes = row(file, y);
+
+	if (m_packed) {
+		memcpy(bytes, src, (size_t) m_width*sizeof(Uint32));
+	}
+	else if (m_format == RAW_PPM) {
+		for (int x = 0; x < m_width; x++, bytes += 3) {
+			bytes[0] = RGB_to_red(src[x]);
+			bytes[1] = RGB_to_green(src[x]);
+			bytes[2] = RGB_to_blue(src[x]);
+		}
+	}
+	else {
+		for (int x = 0; x < m_width; x++) bytes[x] = RGB_to_gray(src[x]);
+	}
+}
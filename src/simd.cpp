@@ -0,0 +1,785 @@
+#include "simd.h"
+
+#include "transforms.h"
+
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+// The AVX-512 headers of some GCC versions trip this warning on their own placeholder values
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#endif
+
+
+using namespace std;
+
+// Scalar reference kernels
+// The vector kernels fall back on these for the pixels left over at the end of a row
+
+static void gray_row_scalar(const Uint32* src, Uint8* dst, int n) {
+	for (int x = 0; x < n; x++) {
+		dst[x] = RGB_to_gray(src[x]);
+	}
+}
+
+static void bitwise_row_scalar(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	for (int x = 0; x < n; x++) {
+		row[x] = (row[x] & and_mask) ^ xor_mask;
+	}
+}
+
+static void gray_replicate_row_scalar(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	for (int x = 0; x < n; x++) {
+		Uint8 gray_value = RGB_to_gray((row[x] & and_mask) ^ xor_mask);
+
+		row[x] = pack_RGB(gray_value, gray_value, gray_value);
+	}
+}
+
+static void threshold_row_scalar(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask, Uint32 threshold) {
+	for (int x = 0; x < n; x++) {
+		Uint32 gray_value = RGB_to_gray((row[x] & and_mask) ^ xor_mask);
+		Uint8 bw_value = (gray_value >= threshold)?0xFF:0x00;
+
+		row[x] = pack_RGB(bw_value, bw_value, bw_value);
+	}
+}
+
+static void unpack_row_scalar(const Uint32* src, Uint8* red, Uint8* green, Uint8* blue, int n) {
+	for (int x = 0; x < n; x++) {
+		red[x] = RGB_to_red(src[x]);
+		green[x] = RGB_to_green(src[x]);
+		blue[x] = RGB_to_blue(src[x]);
+	}
+}
+
+static void pack_row_scalar(const Uint8* red, const Uint8* green, const Uint8* blue, Uint32* dst, int n) {
+	for (int x = 0; x < n; x++) {
+		dst[x] = pack_RGB(red[x], green[x], blue[x]);
+	}
+}
+
+static void lut_row_scalar(Uint32* row, int n, const Uint32* lut) {
+	for (int x = 0; x < n; x++) {
+		Uint32 pixel = row[x];
+
+		row[x] = lut[RGB_to_red(pixel)] | lut[256 + RGB_to_green(pixel)] | lut[512 + RGB_to_blue(pixel)];
+	}
+}
+
+static void threshold_bits_row_scalar(const Uint8* gray, Uint64* bits, int n, Uint32 threshold) {
+	for (int w = 0; 64*w < n; w++) {
+		int x_end = min(64, n - 64*w);
+		Uint64 word = 0;
+
+		for (int x = 0; x < x_end; x++) {
+			word |= ((Uint64) (gray[64*w + x] < threshold)) << x;
+		}
+
+		bits[w] = word;
+	}
+}
+
+// Median of 3x3 neighborhoods through a min/max network
+// Each column of three pixels is sorted once into low, middle and high, the median of a neighborhood is then
+// the median of the largest low, the middle middle and the smallest high of its three columns
+static inline Uint8 med3_scalar(Uint8 a, Uint8 b, Uint8 c) {
+	return max(min(a, b), min(max(a, b), c));
+}
+
+static void median3_row_scalar(const Uint32* above, const Uint32* row, const Uint32* below, Uint32* dst, int n) {
+	for (int x = 1; x < n - 1; x++) {
+		Uint32 pixel = 0;
+
+		for (int c = 0; c < 3; c++) {
+			Uint8 lo[3], mid[3], hi[3];
+
+			for (int u = 0; u < 3; u++) {
+				Uint8 a = (above[x - 1 + u] >> 8*c) & 0xFF;
+				Uint8 b = (row[x - 1 + u] >> 8*c) & 0xFF;
+				Uint8 d = (below[x - 1 + u] >> 8*c) & 0xFF;
+
+				lo[u] = min(min(a, b), d);
+				mid[u] = med3_scalar(a, b, d);
+				hi[u] = max(max(a, b), d);
+			}
+
+			Uint8 median = med3_scalar(max(max(lo[0], lo[1]), lo[2]), med3_scalar(mid[0], mid[1], mid[2]), min(min(hi[0], hi[1]), hi[2]));
+
+			pixel |= ((Uint32) median) << 8*c;
+		}
+
+		dst[x] = pixel;
+	}
+}
+
+// Columns sorted per chunk of the vector kernels
+// Small enough that the sorted columns stay in L1
+#define MEDIAN3_CHUNK 64
+
+#ifdef SIMD_X86
+
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+
+// The gray value is the same fixed point sum of the channels times their weights as RGB_to_gray, so every path gives
+// the same value
+
+// SSE2, 4 pixels per vector
+// SSE2 can't keep the low halves of 32-bit products, the even and odd lanes are multiplied into 64 bits apart
+TARGET_SSE2 static inline __m128i mullo_sse2(__m128i a, __m128i b) {
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, 0x08), _mm_shuffle_epi32(odd, 0x08));
+}
+
+TARGET_SSE2 static inline __m128i gray4_sse2(__m128i pixels) {
+	const __m128i byte_mask = _mm_set1_epi32(0xFF);
+
+	__m128i red = _mm_and_si128(pixels, byte_mask);
+	__m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 8), byte_mask);
+	__m128i blue = _mm_and_si128(_mm_srli_epi32(pixels, 16), byte_mask);
+
+	__m128i sum = _mm_add_epi32(_mm_add_epi32(mullo_sse2(red, _mm_set1_epi32(gray_red)),
+											mullo_sse2(green, _mm_set1_epi32(gray_green))),
+								mullo_sse2(blue, _mm_set1_epi32(gray_blue)));
+
+	return _mm_srli_epi32(sum, GRAY_SHIFT);
+}
+
+// Copy the low byte of each lane into the three color channels
+TARGET_SSE2 static inline __m128i replicate4_sse2(__m128i gray) {
+	return _mm_or_si128(_mm_or_si128(gray, _mm_slli_epi32(gray, 8)), _mm_slli_epi32(gray, 16));
+}
+
+TARGET_SSE2 static void gray_row_sse2(const Uint32* src, Uint8* dst, int n) {
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m128i g0 = gray4_sse2(_mm_loadu_si128((const __m128i*) (src + x)));
+		__m128i g1 = gray4_sse2(_mm_loadu_si128((const __m128i*) (src + x + 4)));
+		__m128i g2 = gray4_sse2(_mm_loadu_si128((const __m128i*) (src + x + 8)));
+		__m128i g3 = gray4_sse2(_mm_loadu_si128((const __m128i*) (src + x + 12)));
+
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(g0, g1), _mm_packs_epi32(g2, g3));
+		_mm_storeu_si128((__m128i*) (dst + x), bytes);
+	}
+
+	gray_row_scalar(src + x, dst + x, n - x);
+}
+
+TARGET_SSE2 static void bitwise_row_sse2(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	const __m128i and_vec = _mm_set1_epi32(and_mask);
+	const __m128i xor_vec = _mm_set1_epi32(xor_mask);
+	int x = 0;
+
+	for (; x + 4 <= n; x += 4) {
+		__m128i pixels = _mm_loadu_si128((const __m128i*) (row + x));
+		_mm_storeu_si128((__m128i*) (row + x), _mm_xor_si128(_mm_and_si128(pixels, and_vec), xor_vec));
+	}
+
+	bitwise_row_scalar(row + x, n - x, and_mask, xor_mask);
+}
+
+TARGET_SSE2 static void gray_replicate_row_sse2(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	const __m128i and_vec = _mm_set1_epi32(and_mask);
+	const __m128i xor_vec = _mm_set1_epi32(xor_mask);
+	int x = 0;
+
+	for (; x + 4 <= n; x += 4) {
+		__m128i pixels = _mm_xor_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*) (row + x)), and_vec), xor_vec);
+		_mm_storeu_si128((__m128i*) (row + x), replicate4_sse2(gray4_sse2(pixels)));
+	}
+
+	gray_replicate_row_scalar(row + x, n - x, and_mask, xor_mask);
+}
+
+TARGET_SSE2 static void threshold_row_sse2(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask, Uint32 threshold) {
+	const __m128i and_vec = _mm_set1_epi32(and_mask);
+	const __m128i xor_vec = _mm_set1_epi32(xor_mask);
+	// gray >= threshold is gray > threshold - 1, gray never exceeds 255
+	const __m128i limit = _mm_set1_epi32((int) ((threshold > 256) ? 256 : threshold) - 1);
+	const __m128i white = _mm_set1_epi32(0x00FFFFFF);
+	int x = 0;
+
+	for (; x + 4 <= n; x += 4) {
+		__m128i pixels = _mm_xor_si128(_mm_and_si128(_mm_loadu_si128((const __m128i*) (row + x)), and_vec), xor_vec);
+		__m128i bw = _mm_and_si128(_mm_cmpgt_epi32(gray4_sse2(pixels), limit), white);
+		_mm_storeu_si128((__m128i*) (row + x), bw);
+	}
+
+	threshold_row_scalar(row + x, n - x, and_mask, xor_mask, threshold);
+}
+
+TARGET_SSE2 static void unpack_row_sse2(const Uint32* src, Uint8* red, Uint8* green, Uint8* blue, int n) {
+	const __m128i byte_mask = _mm_set1_epi32(0xFF);
+	Uint8* planes[3] = {red, green, blue};
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m128i p0 = _mm_loadu_si128((const __m128i*) (src + x));
+		__m128i p1 = _mm_loadu_si128((const __m128i*) (src + x + 4));
+		__m128i p2 = _mm_loadu_si128((const __m128i*) (src + x + 8));
+		__m128i p3 = _mm_loadu_si128((const __m128i*) (src + x + 12));
+
+		for (int c = 0; c < 3; c++) {
+			const __m128i shift = _mm_cvtsi32_si128(8*c);
+
+			__m128i c0 = _mm_and_si128(_mm_srl_epi32(p0, shift), byte_mask);
+			__m128i c1 = _mm_and_si128(_mm_srl_epi32(p1, shift), byte_mask);
+			__m128i c2 = _mm_and_si128(_mm_srl_epi32(p2, shift), byte_mask);
+			__m128i c3 = _mm_and_si128(_mm_srl_epi32(p3, shift), byte_mask);
+
+			__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c3));
+			_mm_storeu_si128((__m128i*) (planes[c] + x), bytes);
+		}
+	}
+
+	unpack_row_scalar(src + x, red + x, green + x, blue + x, n - x);
+}
+
+TARGET_SSE2 static void pack_row_sse2(const Uint8* red, const Uint8* green, const Uint8* blue, Uint32* dst, int n) {
+	const __m128i zero = _mm_setzero_si128();
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m128i r = _mm_loadu_si128((const __m128i*) (red + x));
+		__m128i g = _mm_loadu_si128((const __m128i*) (green + x));
+		__m128i b = _mm_loadu_si128((const __m128i*) (blue + x));
+
+		// Interleave into red | green << 8 and blue | 0 << 8, then into whole pixels
+		__m128i rg_lo = _mm_unpacklo_epi8(r, g);
+		__m128i rg_hi = _mm_unpackhi_epi8(r, g);
+		__m128i b_lo = _mm_unpacklo_epi8(b, zero);
+		__m128i b_hi = _mm_unpackhi_epi8(b, zero);
+
+		_mm_storeu_si128((__m128i*) (dst + x), _mm_unpacklo_epi16(rg_lo, b_lo));
+		_mm_storeu_si128((__m128i*) (dst + x + 4), _mm_unpackhi_epi16(rg_lo, b_lo));
+		_mm_storeu_si128((__m128i*) (dst + x + 8), _mm_unpacklo_epi16(rg_hi, b_hi));
+		_mm_storeu_si128((__m128i*) (dst + x + 12), _mm_unpackhi_epi16(rg_hi, b_hi));
+	}
+
+	pack_row_scalar(red + x, green + x, blue + x, dst + x, n - x);
+}
+
+TARGET_SSE2 static void threshold_bits_row_sse2(const Uint8* gray, Uint64* bits, int n, Uint32 threshold) {
+	// Nothing is below 0 and everything is below 256, otherwise gray < threshold is min(gray, threshold - 1) == gray
+	if (threshold == 0 || threshold > 255) {
+		threshold_bits_row_scalar(gray, bits, n, threshold);
+
+		return;
+	}
+
+	const __m128i limit = _mm_set1_epi8((char) (threshold - 1));
+	int w = 0;
+
+	for (; 64*w + 64 <= n; w++) {
+		Uint64 word = 0;
+
+		for (int i = 0; i < 4; i++) {
+			__m128i values = _mm_loadu_si128((const __m128i*) (gray + 64*w + 16*i));
+			Uint64 below = (Uint16) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(values, limit), values));
+
+			word |= below << 16*i;
+		}
+
+		bits[w] = word;
+	}
+
+	threshold_bits_row_scalar(gray + 64*w, bits + w, n - 64*w, threshold);
+}
+
+// The channels are bytes, so the unsigned byte min/max sorts every channel of the pixels at once
+TARGET_SSE2 static inline __m128i med3_sse2(__m128i a, __m128i b, __m128i c) {
+	return _mm_max_epu8(_mm_min_epu8(a, b), _mm_min_epu8(_mm_max_epu8(a, b), c));
+}
+
+TARGET_SSE2 static void median3_row_sse2(const Uint32* above, const Uint32* row, const Uint32* below, Uint32* dst, int n) {
+	Uint32 lo[MEDIAN3_CHUNK + 4], mid[MEDIAN3_CHUNK + 4], hi[MEDIAN3_CHUNK + 4];
+	int x = 1;
+
+	// Outputs x to x + count - 1 need the columns x - 1 to x + count, sorted in groups of 4 up to x + count + 2
+	for (int count; (count = min(MEDIAN3_CHUNK, (n - 3 - x)/16*16)) > 0; x += count) {
+		for (int i = 0; i < count + 4; i += 4) {
+			__m128i a = _mm_loadu_si128((const __m128i*) (above + x - 1 + i));
+			__m128i b = _mm_loadu_si128((const __m128i*) (row + x - 1 + i));
+			__m128i d = _mm_loadu_si128((const __m128i*) (below + x - 1 + i));
+
+			_mm_storeu_si128((__m128i*) (lo + i), _mm_min_epu8(_mm_min_epu8(a, b), d));
+			_mm_storeu_si128((__m128i*) (mid + i), med3_sse2(a, b, d));
+			_mm_storeu_si128((__m128i*) (hi + i), _mm_max_epu8(_mm_max_epu8(a, b), d));
+		}
+
+		// 16 pixels per iteration
+		for (int i = 0; i < count; i += 16) {
+			for (int j = i; j < i + 16; j += 4) {
+				__m128i lo_max = _mm_max_epu8(_mm_max_epu8(_mm_loadu_si128((const __m128i*) (lo + j)),
+														_mm_loadu_si128((const __m128i*) (lo + j + 1))),
+											_mm_loadu_si128((const __m128i*) (lo + j + 2)));
+				__m128i mid_med = med3_sse2(_mm_loadu_si128((const __m128i*) (mid + j)),
+											_mm_loadu_si128((const __m128i*) (mid + j + 1)),
+											_mm_loadu_si128((const __m128i*) (mid + j + 2)));
+				__m128i hi_min = _mm_min_epu8(_mm_min_epu8(_mm_loadu_si128((const __m128i*) (hi + j)),
+														_mm_loadu_si128((const __m128i*) (hi + j + 1))),
+											_mm_loadu_si128((const __m128i*) (hi + j + 2)));
+
+				_mm_storeu_si128((__m128i*) (dst + x + j), med3_sse2(lo_max, mid_med, hi_min));
+			}
+		}
+	}
+
+	median3_row_scalar(above + x - 1, row + x - 1, below + x - 1, dst + x - 1, n - x + 1);
+}
+
+// AVX2, 8 pixels per vector
+TARGET_AVX2 static inline __m256i gray8_avx2(__m256i pixels) {
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+
+	__m256i red = _mm256_and_si256(pixels, byte_mask);
+	__m256i green = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byte_mask);
+	__m256i blue = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), byte_mask);
+
+	__m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(red, _mm256_set1_epi32(gray_red)),
+													_mm256_mullo_epi32(green, _mm256_set1_epi32(gray_green))),
+									_mm256_mullo_epi32(blue, _mm256_set1_epi32(gray_blue)));
+
+	return _mm256_srli_epi32(sum, GRAY_SHIFT);
+}
+
+TARGET_AVX2 static inline __m256i replicate8_avx2(__m256i gray) {
+	return _mm256_or_si256(_mm256_or_si256(gray, _mm256_slli_epi32(gray, 8)), _mm256_slli_epi32(gray, 16));
+}
+
+// Narrow four vectors of 32-bit lanes holding bytes into one vector of 32 bytes in order
+TARGET_AVX2 static inline __m256i narrow32_avx2(__m256i v0, __m256i v1, __m256i v2, __m256i v3) {
+	// The packs work within 128-bit halves so the 4-byte groups come out interleaved
+	__m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(v0, v1), _mm256_packs_epi32(v2, v3));
+
+	return _mm256_permutevar8x32_epi32(bytes, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+TARGET_AVX2 static void gray_row_avx2(const Uint32* src, Uint8* dst, int n) {
+	int x = 0;
+
+	for (; x + 32 <= n; x += 32) {
+		__m256i g0 = gray8_avx2(_mm256_loadu_si256((const __m256i*) (src + x)));
+		__m256i g1 = gray8_avx2(_mm256_loadu_si256((const __m256i*) (src + x + 8)));
+		__m256i g2 = gray8_avx2(_mm256_loadu_si256((const __m256i*) (src + x + 16)));
+		__m256i g3 = gray8_avx2(_mm256_loadu_si256((const __m256i*) (src + x + 24)));
+
+		_mm256_storeu_si256((__m256i*) (dst + x), narrow32_avx2(g0, g1, g2, g3));
+	}
+
+	gray_row_scalar(src + x, dst + x, n - x);
+}
+
+TARGET_AVX2 static void bitwise_row_avx2(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	const __m256i and_vec = _mm256_set1_epi32(and_mask);
+	const __m256i xor_vec = _mm256_set1_epi32(xor_mask);
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i*) (row + x));
+		_mm256_storeu_si256((__m256i*) (row + x), _mm256_xor_si256(_mm256_and_si256(pixels, and_vec), xor_vec));
+	}
+
+	bitwise_row_scalar(row + x, n - x, and_mask, xor_mask);
+}
+
+TARGET_AVX2 static void gray_replicate_row_avx2(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	const __m256i and_vec = _mm256_set1_epi32(and_mask);
+	const __m256i xor_vec = _mm256_set1_epi32(xor_mask);
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8) {
+		__m256i pixels = _mm256_xor_si256(_mm256_and_si256(_mm256_loadu_si256((const __m256i*) (row + x)), and_vec), xor_vec);
+		_mm256_storeu_si256((__m256i*) (row + x), replicate8_avx2(gray8_avx2(pixels)));
+	}
+
+	gray_replicate_row_scalar(row + x, n - x, and_mask, xor_mask);
+}
+
+TARGET_AVX2 static void threshold_row_avx2(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask, Uint32 threshold) {
+	const __m256i and_vec = _mm256_set1_epi32(and_mask);
+	const __m256i xor_vec = _mm256_set1_epi32(xor_mask);
+	const __m256i limit = _mm256_set1_epi32((int) ((threshold > 256) ? 256 : threshold) - 1);
+	const __m256i white = _mm256_set1_epi32(0x00FFFFFF);
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8) {
+		__m256i pixels = _mm256_xor_si256(_mm256_and_si256(_mm256_loadu_si256((const __m256i*) (row + x)), and_vec), xor_vec);
+		__m256i bw = _mm256_and_si256(_mm256_cmpgt_epi32(gray8_avx2(pixels), limit), white);
+		_mm256_storeu_si256((__m256i*) (row + x), bw);
+	}
+
+	threshold_row_scalar(row + x, n - x, and_mask, xor_mask, threshold);
+}
+
+TARGET_AVX2 static void unpack_row_avx2(const Uint32* src, Uint8* red, Uint8* green, Uint8* blue, int n) {
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	Uint8* planes[3] = {red, green, blue};
+	int x = 0;
+
+	for (; x + 32 <= n; x += 32) {
+		__m256i p0 = _mm256_loadu_si256((const __m256i*) (src + x));
+		__m256i p1 = _mm256_loadu_si256((const __m256i*) (src + x + 8));
+		__m256i p2 = _mm256_loadu_si256((const __m256i*) (src + x + 16));
+		__m256i p3 = _mm256_loadu_si256((const __m256i*) (src + x + 24));
+
+		for (int c = 0; c < 3; c++) {
+			const __m128i shift = _mm_cvtsi32_si128(8*c);
+
+			__m256i bytes = narrow32_avx2(_mm256_and_si256(_mm256_srl_epi32(p0, shift), byte_mask),
+										_mm256_and_si256(_mm256_srl_epi32(p1, shift), byte_mask),
+										_mm256_and_si256(_mm256_srl_epi32(p2, shift), byte_mask),
+										_mm256_and_si256(_mm256_srl_epi32(p3, shift), byte_mask));
+			_mm256_storeu_si256((__m256i*) (planes[c] + x), bytes);
+		}
+	}
+
+	unpack_row_scalar(src + x, red + x, green + x, blue + x, n - x);
+}
+
+TARGET_AVX2 static void pack_row_avx2(const Uint8* red, const Uint8* green, const Uint8* blue, Uint32* dst, int n) {
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8) {
+		__m256i r = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (red + x)));
+		__m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (green + x)));
+		__m256i b = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (blue + x)));
+
+		__m256i pixels = _mm256_or_si256(_mm256_or_si256(r, _mm256_slli_epi32(g, 8)), _mm256_slli_epi32(b, 16));
+		_mm256_storeu_si256((__m256i*) (dst + x), pixels);
+	}
+
+	pack_row_scalar(red + x, green + x, blue + x, dst + x, n - x);
+}
+
+// One gather from each channel table per 8 pixels
+TARGET_AVX2 static void lut_row_avx2(Uint32* row, int n, const Uint32* lut) {
+	const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+	const __m256i green_offset = _mm256_set1_epi32(256);
+	const __m256i blue_offset = _mm256_set1_epi32(512);
+	int x = 0;
+
+	for (; x + 8 <= n; x += 8) {
+		__m256i pixels = _mm256_loadu_si256((const __m256i*) (row + x));
+
+		__m256i red = _mm256_and_si256(pixels, byte_mask);
+		__m256i green = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(pixels, 8), byte_mask), green_offset);
+		__m256i blue = _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(pixels, 16), byte_mask), blue_offset);
+
+		__m256i mapped = _mm256_or_si256(_mm256_or_si256(_mm256_i32gather_epi32((const int*) lut, red, 4),
+														_mm256_i32gather_epi32((const int*) lut, green, 4)),
+										_mm256_i32gather_epi32((const int*) lut, blue, 4));
+		_mm256_storeu_si256((__m256i*) (row + x), mapped);
+	}
+
+	lut_row_scalar(row + x, n - x, lut);
+}
+
+TARGET_AVX2 static void threshold_bits_row_avx2(const Uint8* gray, Uint64* bits, int n, Uint32 threshold) {
+	if (threshold == 0 || threshold > 255) {
+		threshold_bits_row_scalar(gray, bits, n, threshold);
+
+		return;
+	}
+
+	const __m256i limit = _mm256_set1_epi8((char) (threshold - 1));
+	int w = 0;
+
+	for (; 64*w + 64 <= n; w++) {
+		__m256i values_lo = _mm256_loadu_si256((const __m256i*) (gray + 64*w));
+		__m256i values_hi = _mm256_loadu_si256((const __m256i*) (gray + 64*w + 32));
+		Uint64 below_lo = (Uint32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(values_lo, limit), values_lo));
+		Uint64 below_hi = (Uint32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(values_hi, limit), values_hi));
+
+		bits[w] = below_lo | (below_hi << 32);
+	}
+
+	threshold_bits_row_scalar(gray + 64*w, bits + w, n - 64*w, threshold);
+}
+
+TARGET_AVX2 static inline __m256i med3_avx2(__m256i a, __m256i b, __m256i c) {
+	return _mm256_max_epu8(_mm256_min_epu8(a, b), _mm256_min_epu8(_mm256_max_epu8(a, b), c));
+}
+
+TARGET_AVX2 static void median3_row_avx2(const Uint32* above, const Uint32* row, const Uint32* below, Uint32* dst, int n) {
+	Uint32 lo[MEDIAN3_CHUNK + 8], mid[MEDIAN3_CHUNK + 8], hi[MEDIAN3_CHUNK + 8];
+	int x = 1;
+
+	// Outputs x to x + count - 1 need the columns x - 1 to x + count, sorted in groups of 8 up to x + count + 6
+	for (int count; (count = min(MEDIAN3_CHUNK, (n - 7 - x)/16*16)) > 0; x += count) {
+		for (int i = 0; i < count + 8; i += 8) {
+			__m256i a = _mm256_loadu_si256((const __m256i*) (above + x - 1 + i));
+			__m256i b = _mm256_loadu_si256((const __m256i*) (row + x - 1 + i));
+			__m256i d = _mm256_loadu_si256((const __m256i*) (below + x - 1 + i));
+
+			_mm256_storeu_si256((__m256i*) (lo + i), _mm256_min_epu8(_mm256_min_epu8(a, b), d));
+			_mm256_storeu_si256((__m256i*) (mid + i), med3_avx2(a, b, d));
+			_mm256_storeu_si256((__m256i*) (hi + i), _mm256_max_epu8(_mm256_max_epu8(a, b), d));
+		}
+
+		// 16 pixels per iteration
+		for (int i = 0; i < count; i += 16) {
+			for (int j = i; j < i + 16; j += 8) {
+				__m256i lo_max = _mm256_max_epu8(_mm256_max_epu8(_mm256_loadu_si256((const __m256i*) (lo + j)),
+																_mm256_loadu_si256((const __m256i*) (lo + j + 1))),
+												_mm256_loadu_si256((const __m256i*) (lo + j + 2)));
+				__m256i mid_med = med3_avx2(_mm256_loadu_si256((const __m256i*) (mid + j)),
+											_mm256_loadu_si256((const __m256i*) (mid + j + 1)),
+											_mm256_loadu_si256((const __m256i*) (mid + j + 2)));
+				__m256i hi_min = _mm256_min_epu8(_mm256_min_epu8(_mm256_loadu_si256((const __m256i*) (hi + j)),
+																_mm256_loadu_si256((const __m256i*) (hi + j + 1))),
+												_mm256_loadu_si256((const __m256i*) (hi + j + 2)));
+
+				_mm256_storeu_si256((__m256i*) (dst + x + j), med3_avx2(lo_max, mid_med, hi_min));
+			}
+		}
+	}
+
+	median3_row_scalar(above + x - 1, row + x - 1, below + x - 1, dst + x - 1, n - x + 1);
+}
+
+// AVX-512, 16 pixels per vector
+TARGET_AVX512 static inline __m512i gray16_avx512(__m512i pixels) {
+	const __m512i byte_mask = _mm512_set1_epi32(0xFF);
+
+	__m512i red = _mm512_and_si512(pixels, byte_mask);
+	__m512i green = _mm512_and_si512(_mm512_srli_epi32(pixels, 8), byte_mask);
+	__m512i blue = _mm512_and_si512(_mm512_srli_epi32(pixels, 16), byte_mask);
+
+	__m512i sum = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(red, _mm512_set1_epi32(gray_red)),
+													_mm512_mullo_epi32(green, _mm512_set1_epi32(gray_green))),
+									_mm512_mullo_epi32(blue, _mm512_set1_epi32(gray_blue)));
+
+	return _mm512_srli_epi32(sum, GRAY_SHIFT);
+}
+
+TARGET_AVX512 static inline __m512i replicate16_avx512(__m512i gray) {
+	return _mm512_or_si512(_mm512_or_si512(gray, _mm512_slli_epi32(gray, 8)), _mm512_slli_epi32(gray, 16));
+}
+
+TARGET_AVX512 static void gray_row_avx512(const Uint32* src, Uint8* dst, int n) {
+	int x = 0;
+
+	for (; x + 64 <= n; x += 64) {
+		for (int i = 0; i < 64; i += 16) {
+			__m512i gray = gray16_avx512(_mm512_loadu_si512((const void*) (src + x + i)));
+			_mm_storeu_si128((__m128i*) (dst + x + i), _mm512_cvtepi32_epi8(gray));
+		}
+	}
+
+	gray_row_scalar(src + x, dst + x, n - x);
+}
+
+TARGET_AVX512 static void bitwise_row_avx512(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	const __m512i and_vec = _mm512_set1_epi32(and_mask);
+	const __m512i xor_vec = _mm512_set1_epi32(xor_mask);
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m512i pixels = _mm512_loadu_si512((const void*) (row + x));
+		_mm512_storeu_si512((void*) (row + x), _mm512_xor_si512(_mm512_and_si512(pixels, and_vec), xor_vec));
+	}
+
+	bitwise_row_scalar(row + x, n - x, and_mask, xor_mask);
+}
+
+TARGET_AVX512 static void gray_replicate_row_avx512(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	const __m512i and_vec = _mm512_set1_epi32(and_mask);
+	const __m512i xor_vec = _mm512_set1_epi32(xor_mask);
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m512i pixels = _mm512_xor_si512(_mm512_and_si512(_mm512_loadu_si512((const void*) (row + x)), and_vec), xor_vec);
+		_mm512_storeu_si512((void*) (row + x), replicate16_avx512(gray16_avx512(pixels)));
+	}
+
+	gray_replicate_row_scalar(row + x, n - x, and_mask, xor_mask);
+}
+
+TARGET_AVX512 static void threshold_row_avx512(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask, Uint32 threshold) {
+	const __m512i and_vec = _mm512_set1_epi32(and_mask);
+	const __m512i xor_vec = _mm512_set1_epi32(xor_mask);
+	const __m512i limit = _mm512_set1_epi32((int) ((threshold > 256) ? 256 : threshold) - 1);
+	const __m512i white = _mm512_set1_epi32(0x00FFFFFF);
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m512i pixels = _mm512_xor_si512(_mm512_and_si512(_mm512_loadu_si512((const void*) (row + x)), and_vec), xor_vec);
+		__mmask16 is_white = _mm512_cmpgt_epi32_mask(gray16_avx512(pixels), limit);
+		_mm512_storeu_si512((void*) (row + x), _mm512_maskz_mov_epi32(is_white, white));
+	}
+
+	threshold_row_scalar(row + x, n - x, and_mask, xor_mask, threshold);
+}
+
+TARGET_AVX512 static void unpack_row_avx512(const Uint32* src, Uint8* red, Uint8* green, Uint8* blue, int n) {
+	const __m512i byte_mask = _mm512_set1_epi32(0xFF);
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m512i pixels = _mm512_loadu_si512((const void*) (src + x));
+
+		_mm_storeu_si128((__m128i*) (red + x), _mm512_cvtepi32_epi8(_mm512_and_si512(pixels, byte_mask)));
+		_mm_storeu_si128((__m128i*) (green + x), _mm512_cvtepi32_epi8(_mm512_and_si512(_mm512_srli_epi32(pixels, 8), byte_mask)));
+		_mm_storeu_si128((__m128i*) (blue + x), _mm512_cvtepi32_epi8(_mm512_and_si512(_mm512_srli_epi32(pixels, 16), byte_mask)));
+	}
+
+	unpack_row_scalar(src + x, red + x, green + x, blue + x, n - x);
+}
+
+TARGET_AVX512 static void pack_row_avx512(const Uint8* red, const Uint8* green, const Uint8* blue, Uint32* dst, int n) {
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m512i r = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (red + x)));
+		__m512i g = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (green + x)));
+		__m512i b = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*) (blue + x)));
+
+		__m512i pixels = _mm512_or_si512(_mm512_or_si512(r, _mm512_slli_epi32(g, 8)), _mm512_slli_epi32(b, 16));
+		_mm512_storeu_si512((void*) (dst + x), pixels);
+	}
+
+	pack_row_scalar(red + x, green + x, blue + x, dst + x, n - x);
+}
+
+TARGET_AVX512 static void lut_row_avx512(Uint32* row, int n, const Uint32* lut) {
+	const __m512i byte_mask = _mm512_set1_epi32(0xFF);
+	const __m512i green_offset = _mm512_set1_epi32(256);
+	const __m512i blue_offset = _mm512_set1_epi32(512);
+	int x = 0;
+
+	for (; x + 16 <= n; x += 16) {
+		__m512i pixels = _mm512_loadu_si512((const void*) (row + x));
+
+		__m512i red = _mm512_and_si512(pixels, byte_mask);
+		__m512i green = _mm512_add_epi32(_mm512_and_si512(_mm512_srli_epi32(pixels, 8), byte_mask), green_offset);
+		__m512i blue = _mm512_add_epi32(_mm512_and_si512(_mm512_srli_epi32(pixels, 16), byte_mask), blue_offset);
+
+		__m512i mapped = _mm512_or_si512(_mm512_or_si512(_mm512_i32gather_epi32(red, (const void*) lut, 4),
+														_mm512_i32gather_epi32(green, (const void*) lut, 4)),
+										_mm512_i32gather_epi32(blue, (const void*) lut, 4));
+		_mm512_storeu_si512((void*) (row + x), mapped);
+	}
+
+	lut_row_scalar(row + x, n - x, lut);
+}
+
+#endif
+
+// Table of the kernels for one instruction set
+struct simd_kernels {
+	void (*gray_row)(const Uint32*, Uint8*, int);
+	void (*bitwise_row)(Uint32*, int, Uint32, Uint32);
+	void (*gray_replicate_row)(Uint32*, int, Uint32, Uint32);
+	void (*threshold_row)(Uint32*, int, Uint32, Uint32, Uint32);
+	void (*unpack_row)(const Uint32*, Uint8*, Uint8*, Uint8*, int);
+	void (*pack_row)(const Uint8*, const Uint8*, const Uint8*, Uint32*, int);
+	void (*lut_row)(Uint32*, int, const Uint32*);
+	void (*median3_row)(const Uint32*, const Uint32*, const Uint32*, Uint32*, int);
+	void (*threshold_bits_row)(const Uint8*, Uint64*, int, Uint32);
+};
+
+static simd_kernels kernels_for(simd_level level) {
+	switch (level) {
+#ifdef SIMD_X86
+		// AVX-512F has no byte min/max or compares, those kernels stay on AVX2
+		case SIMD_AVX512:
+			return {gray_row_avx512, bitwise_row_avx512, gray_replicate_row_avx512, threshold_row_avx512,
+					unpack_row_avx512, pack_row_avx512, lut_row_avx512, median3_row_avx2, threshold_bits_row_avx2};
+		case SIMD_AVX2:
+			return {gray_row_avx2, bitwise_row_avx2, gray_replicate_row_avx2, threshold_row_avx2,
+					unpack_row_avx2, pack_row_avx2, lut_row_avx2, median3_row_avx2, threshold_bits_row_avx2};
+		case SIMD_SSE2:
+			// SSE2 has no gathers
+			return {gray_row_sse2, bitwise_row_sse2, gray_replicate_row_sse2, threshold_row_sse2,
+					unpack_row_sse2, pack_row_sse2, lut_row_scalar, median3_row_sse2, threshold_bits_row_sse2};
+#endif
+		default:
+			return {gray_row_scalar, bitwise_row_scalar, gray_replicate_row_scalar, threshold_row_scalar,
+					unpack_row_scalar, pack_row_scalar, lut_row_scalar, median3_row_scalar, threshold_bits_row_scalar};
+	}
+}
+
+static simd_level& current_level() {
+	static simd_level level = simd_detect();
+
+	return level;
+}
+
+static simd_kernels& current_kernels() {
+	static simd_kernels kernels = kernels_for(current_level());
+
+	return kernels;
+}
+
+simd_level simd_detect() {
+#ifdef SIMD_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+
+	return SIMD_SCALAR;
+}
+
+simd_level simd_get() { return current_level(); }
+
+void simd_set(simd_level level) {
+	if (level > simd_detect()) level = simd_detect();
+
+	current_level() = level;
+	current_kernels() = kernels_for(level);
+}
+
+const char* simd_name(simd_level level) {
+	switch (level) {
+		case SIMD_AVX512: return "avx512";
+		case SIMD_AVX2: return "avx2";
+		case SIMD_SSE2: return "sse2";
+		default: return "scalar";
+	}
+}
+
+void simd_gray_row(const Uint32* src, Uint8* dst, int n) {
+	current_kernels().gray_row(src, dst, n);
+}
+
+void simd_bitwise_row(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	current_kernels().bitwise_row(row, n, and_mask, xor_mask);
+}
+
+void simd_gray_replicate_row(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask) {
+	current_kernels().gray_replicate_row(row, n, and_mask, xor_mask);
+}
+
+void simd_threshold_row(Uint32* row, int n, Uint32 and_mask, Uint32 xor_mask, Uint32 threshold) {
+	current_kernels().threshold_row(row, n, and_mask, xor_mask, threshold);
+}
+
+void simd_unpack_row(const Uint32* src, Uint8* red, Uint8* green, Uint8* blue, int n) {
+	current_kernels().unpack_row(src, red, green, blue, n);
+}
+
+void simd_pack_row(const Uint8* red, const Uint8* green, const Uint8* blue, Uint32* dst, int n) {
+	current_kernels().pack_row(red, green, blue, dst, n);
+}
+
+void simd_lut_row(Uint32* row, int n, const Uint32* lut) {
+	current_kernels().lut_row(row, n, lut);
+}
+
+void simd_median3_row(const Uint32* above, const Uint32* row, const Uint32* below, Uint32* dst, int n) {
+	current_kernels().median3_row(above, row, below, dst, n);
+}
+
+void simd_threshold_bits_row(const Uint8* gray, Uint64* bits, int n, Uint32 threshold) {
+	current_kernels().threshold_bits_row(gray, bits, n, threshold);
+}
@@ -0,0 +1,154 @@
+#include "stream.h"
+
+#include "profile.h"
+#include "strip_io.h"
+
+#include <cstring>
+#include <memory>
+
+
+using namespace std;
+
+// Passes the rows [begin, end) of a strip, whose row 0 is row y_first of the image, to the next stage
+typedef function<void(image_io& strip, int begin, int end, int y_first)> strip_emit;
+
+// Rows of the image as one stage sees them
+// A stage with a halo collects rows into a window of its own, transforms it once full and passes on the rows
+// more than a halo away from its ends, then keeps the last two halos of original rows to start the next window with
+class strip_window {
+	public:
+		strip_window(const strip_stage& stage, int width, int strip_rows)
+			: m_stage(stage), m_halo(stage.halo), m_first(0), m_rows(0) {
+			if (m_halo > 0) {
+				m_window.reset(new image_io(width, strip_rows + 2*m_halo));
+				m_saved.resize((size_t) 2*m_halo*width);
+			}
+		}
+
+		// Take the next rows of the image
+		void push(image_io& strip, int begin, int end, int y_first, const strip_emit& emit) {
+			if (begin >= end) return;
+
+			// Nothing to collect, work on the rows where they are
+			if (m_halo == 0) {
+				if (m_stage.transform) {
+					image_io view(strip, begin, end - begin);
+
+					m_stage.transform(view);
+
+					// The view's gray plane is its own
+					strip.invalidate_gray();
+				}
+
+				pass_on(strip, begin, end, y_first, emit);
+
+				return;
+			}
+
+			while (begin < end) {
+				int count = min(end - begin, m_window->height() - m_rows);
+
+				memcpy(m_window->row(m_rows), strip.row(begin), (size_t) count*strip.width()*sizeof(Uint32));
+				m_window->invalidate_gray();
+
+				m_rows += count;
+				begin += count;
+
+				if (m_rows == m_window->height()) flush(false, emit);
+			}
+		}
+
+		// Pass on whatever rows are left once the image has been read
+		void finish(const strip_emit& emit) {
+			if (m_halo > 0 && m_rows > 0) flush(true, emit);
+		}
+
+	private:
+		void flush(bool last, const strip_emit& emit) {
+			// Rows within a halo of the ends of the window are only read, unless they're the ends of the image
+			int out_begin = (m_first == 0) ? 0 : m_halo;
+			int out_end = last ? m_rows : m_rows - m_halo;
+
+			// The next window starts with the original rows this one ends with
+			if (!last) memcpy(m_saved.data(), m_window->row(m_rows - 2*m_halo), m_saved.size()*sizeof(Uint32));
+
+			if (m_stage.transform) {
+				image_io view(*m_window, 0, m_rows);
+
+				m_stage.transform(view);
+
+				m_window->invalidate_gray();
+			}
+
+			if (out_begin < out_end) pass_on(*m_window, out_begin, out_end, m_first, emit);
+
+			if (!last) {
+				memcpy(m_window->row(0), m_saved.data(), m_saved.size()*sizeof(Uint32));
+				m_window->invalidate_gray();
+
+				m_first += m_rows - 2*m_halo;
+				m_rows = 2*m_halo;
+			}
+		}
+
+		void pass_on(image_io& strip, int begin, int end, int y_first, const strip_emit& emit) {
+			if (m_stage.measure) m_stage.measure(strip, begin, end, y_first);
+
+			emit(strip, begin, end, y_first);
+		}
+
+		const strip_stage& m_stage;
+		int m_halo;
+
+		unique_ptr<image_io> m_window;
+		// Row of the image in the first row of the window, and rows of the window filled
+		int m_first;
+		int m_rows;
+
+		vector<Uint32> m_saved;
+};
+
+void run_stream(const char* input_file, const vector<strip_stage>& stages, int strip_rows) {
+	strip_reader reader(input_file);
+
+	int width = reader.width();
+	int height = reader.height();
+
+	PROFILE_SCOPE("stream", (Uint64) width*height);
+
+	strip_rows = max(strip_rows, 1);
+
+	vector<unique_ptr<strip_window>> windows;
+
+	for (const strip_stage& stage : stages) windows.push_back(unique_ptr<strip_window>(new strip_window(stage, width, strip_rows)));
+
+	// Hand rows to stage i, which hands the ones it finishes to stage i + 1
+	function<void(size_t, image_io&, int, int, int)> feed = [&](size_t i, image_io& strip, int begin, int end, int y_first) {
+		if (i == windows.size()) return;
+
+		windows[i]->push(strip, begin, end, y_first, [&](image_io& strip_next, int begin_next, int end_next, int y_next) {
+			feed(i + 1, strip_next, begin_next, end_next, y_next);
+		});
+	};
+
+	image_io strip(width, strip_rows);
+
+	for (int y = 0; y < height; y += strip_rows) {
+		int count = min(strip_rows, height - y);
+
+		{
+			PROFILE_SCOPE("load", (Uint64) width*count);
+
+			reader.read(strip, count);
+		}
+
+		feed(0, strip, 0, count, y);
+	}
+
+	// Each stage hands its last rows on before the one after it finishes
+	for (size_t i = 0; i < windows.size(); i++) {
+		windows[i]->finish([&](image_io& strip_next, int begin_next, int end_next, int y_next) {
+			feed(i + 1, strip_next, begin_next, end_next, y_next);
+		});
+	}
+}
@@ -0,0 +1,36 @@
+#include "strip_io.h"
+
+#include <string>
+
+
+using namespace std;
+
+strip_reader::strip_reader(const char* filename) : m_file(filename), m_next(0) {
+	if (!m_layout.parse(m_file.data(), m_file.size())) {
+		throw image_error(string(filename) + " can't be streamed, only uncompressed 8, 24 and 32-bit BMPs and 8-bit binary PPM and PGM images can");
+	}
+
+	// Strips are images of their own, as wide as the image
+	if (width() > IMAGE_MAX_WIDTH) {
+		throw image_error(string(filename) + " can't be streamed, strips can be at most " + to_string(IMAGE_MAX_WIDTH) + " pixels wide");
+	}
+}
+
+void strip_reader::read(image_io& strip, int count) {
+	if (m_next + count > height()) throw image_error("Read past the last row");
+
+	for (int i = 0; i < count; i++) m_layout.read_row(m_file.data(), m_next++, strip.row(i));
+
+	strip.invalidate_gray();
+}
+
+strip_writer::strip_writer(const char* filename, int width, int height)
+	: m_layout(raw_format_for(filename), width, height), m_file(filename, m_layout.size()), m_next(0) {
+	m_layout.write_header(m_file.data());
+}
+
+void strip_writer::write(image_io& strip, int begin, int end) {
+	if (m_next + end - begin > m_layout.height()) throw image_error("Wrote past the last row");
+
+	for (int y = begin; y < end; y++) m_layout.write_row(m_file.data(), m_next++, strip.row(y));
+}
@@ -0,0 +1,163 @@
+#include "thread_pool.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+using namespace std;
+
+// Set while the thread is running a task, or for good by set_serial
+static bool& in_task() {
+	static thread_local bool flag = false;
+
+	return flag;
+}
+
+// Workers sleep between calls and all wake up for each parallel_for
+class thread_pool {
+	public:
+		thread_pool() : m_task(NULL), m_count(0), m_next(0), m_active(0), m_generation(0), m_stop(false) {}
+
+		~thread_pool() {
+			resize(1);
+		}
+
+		// Keep threads - 1 workers, the calling thread makes up the last one
+		void resize(int threads) {
+			lock_guard<mutex> run_lock(m_run);
+
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_stop = true;
+			}
+
+			m_start.notify_all();
+
+			for (size_t i = 0; i < m_workers.size(); i++) m_workers[i].join();
+
+			m_workers.clear();
+
+			unsigned generation;
+
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_stop = false;
+				generation = m_generation;
+			}
+
+			// New workers start from the current generation, or they'd take the last run for a new one
+			for (int i = 1; i < threads; i++) m_workers.push_back(thread(&thread_pool::work, this, generation));
+		}
+
+		int size() const {
+			return m_workers.size() + 1;
+		}
+
+		void run(int count, const function<void(int)>& task) {
+			unique_lock<mutex> run_lock(m_run, try_to_lock);
+
+			// Nested or concurrent calls don't get any workers
+			if (in_task() || !run_lock.owns_lock() || m_workers.empty() || count <= 1) {
+				for (int i = 0; i < count; i++) task(i);
+
+				return;
+			}
+
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_task = &task;
+				m_count = count;
+				m_next = 0;
+				m_active = m_workers.size();
+				m_generation++;
+			}
+
+			m_start.notify_all();
+
+			take_tasks();
+
+			// Wait for the workers to finish their last task
+			unique_lock<mutex> lock(m_mutex);
+			m_done.wait(lock, [this] { return m_active == 0; });
+
+			m_task = NULL;
+		}
+
+	private:
+		void take_tasks() {
+			bool serial = in_task();
+
+			in_task() = true;
+
+			for (int i; (i = m_next++) < m_count;) (*m_task)(i);
+
+			in_task() = serial;
+		}
+
+		void work(unsigned generation) {
+			for (;;) {
+				{
+					unique_lock<mutex> lock(m_mutex);
+					m_start.wait(lock, [&] { return m_stop || m_generation != generation; });
+
+					if (m_stop) return;
+
+					generation = m_generation;
+				}
+
+				take_tasks();
+
+				{
+					lock_guard<mutex> lock(m_mutex);
+					m_active--;
+				}
+
+				m_done.notify_one();
+			}
+		}
+
+		vector<thread> m_workers;
+
+		// Held for the whole of a parallel_for
+		mutex m_run;
+
+		// Guards the fields below and the wake-ups
+		mutex m_mutex;
+		condition_variable m_start;
+		condition_variable m_done;
+
+		const function<void(int)>* m_task;
+		int m_count;
+		atomic<int> m_next;
+		int m_active;
+		unsigned m_generation;
+		bool m_stop;
+};
+
+static thread_pool& pool() {
+	static thread_pool instance;
+
+	return instance;
+}
+
+void set_threads(int threads) {
+	if (threads <= 0) threads = thread::hardware_concurrency();
+	if (threads <= 0) threads = 1;
+
+	pool().resize(threads);
+}
+
+int get_threads() {
+	return pool().size();
+}
+
+void parallel_for(int count, const function<void(int)>& task) {
+	pool().run(count, task);
+}
+
+void set_serial(bool serial) {
+	in_task() = serial;
+}
@@ -1,10 +1,19 @@
 #include "transforms.h"
 
+#include "bands.h"
+#include "convolution.h"
+#include "histogram.h"
+#include "line_buffer.h"
+#include "point_ops.h"
+#include "profile.h"
+#include "simd.h"
+
 #include <iostream>
 #include <vector>
 #include <algorithm>
 #include <cmath>
 #include <array>
+#include <cstring>
 
 #include <SDL/SDL.h>
 #include <SDL/SDL_image.h>
@@ -26,561 +35,1083 @@ locker::~locker() {
 }
 
 void color_mask(image_io& image_src, int c_mask) {
-	locker lock(image_src);
+	PROFILE_SCOPE("color_mask", (Uint64) image_src.width()*image_src.height());
+
+	point_ops ops;
+
+	ops.add_color_mask(c_mask);
+	ops.apply(image_src);
+}
+
+void invert(image_io& image_src) {
+	PROFILE_SCOPE("invert", (Uint64) image_src.width()*image_src.height());
+
+	point_ops ops;
+
+	ops.add_invert();
+	ops.apply(image_src);
+}
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+// Averages a (2*radius + 1) square neighborhood using running sums
+// Column sums slide down the image and a horizontal sum slides along each row, so the cost per pixel doesn't depend on the radius
+static void smooth_mean_band(band_rows& band, int width, int radius) {
+	int diameter = 2*radius + 1;
 
-	Uint32 red_value, green_value, blue_value;
+	// Copies of the original rows in the neighborhood, the ones above the current row get overwritten
+	line_buffer lines(width, diameter);
 
-	// Iterate through every pixel
-	for (int x = 0; x < image_src.get_image()->w; x++) {
-		red_value = green_value = blue_value = 0;
+	// Per-channel sums of each column over the rows in the neighborhood
+	vector<Uint32> column_sum(3*width, 0);
+	Uint32* R_sum = &column_sum[0];
+	Uint32* G_sum = &column_sum[width];
+	Uint32* B_sum = &column_sum[2*width];
 
-		for (int y = 0; y < image_src.get_image()->h; y++) {
-			pixel_src = image_src.get_pixel(x, y);
+	for (int y = band.begin() - radius; y <= band.begin() + radius; y++) {
+		const Uint32* row_src = band.row(y);
 
-			// Strip colors depending on c_mask
-			if (((c_mask & M_RED) != M_RED)) red_value = RGB_to_red(pixel_src);
-			if (((c_mask & M_GREEN) != M_GREEN)) green_value = RGB_to_green(pixel_src);
-			if (((c_mask & M_BLUE) != M_BLUE)) blue_value = RGB_to_blue(pixel_src);
+		lines.push(y, row_src);
 
-			// If all colors are masked, display in grayscale
-			if ((c_mask == (M_RED | M_GREEN | M_BLUE))) {
-				red_value = green_value = blue_value = RGB_to_gray(pixel_src);
+		for (int x = 0; x < width; x++) {
+			R_sum[x] += RGB_to_red(row_src[x]);
+			G_sum[x] += RGB_to_green(row_src[x]);
+			B_sum[x] += RGB_to_blue(row_src[x]);
+		}
+	}
+
+	// Every pixel has an equal weight of 1/area
+	// Divide with a multiply and shift, exact as long as 255*area*area < 2^40
+	Uint64 area = (Uint64) diameter*diameter;
+	Uint64 reciprocal = (((Uint64) 1) << 40)/area + 1;
+	bool use_reciprocal = 255*area*area < (((Uint64) 1) << 40);
+
+	// Iterate through every pixel of the band, skip the outer edges
+	for (int y = band.begin(); y < band.end(); y++) {
+		Uint32* row_dst = band.row_dst(y);
+
+		// Variable to hold the pixel sum throughout the neighborhood
+		Uint64 R_avg = 0;
+		Uint64 G_avg = 0;
+		Uint64 B_avg = 0;
+
+		for (int x = 0; x < diameter - 1; x++) {
+			R_avg += R_sum[x];
+			G_avg += G_sum[x];
+			B_avg += B_sum[x];
+		}
+
+		for (int x = radius; x < width - radius; x++) {
+			// Slide the right column in
+			R_avg += R_sum[x + radius];
+			G_avg += G_sum[x + radius];
+			B_avg += B_sum[x + radius];
+
+			// Pack the color averages back into a single pixel
+			if (use_reciprocal) {
+				row_dst[x] = (((R_avg*reciprocal) >> 40) << 0)
+							| (((G_avg*reciprocal) >> 40) << 8)
+							| (((B_avg*reciprocal) >> 40) << 16);
+			}
+			else {
+				row_dst[x] = ((R_avg/area) << 0)
+							| ((G_avg/area) << 8)
+							| ((B_avg/area) << 16);
 			}
 
-			pixel_dst = pack_RGB(red_value, green_value, blue_value);
+			// Slide the left column out
+			R_avg -= R_sum[x - radius];
+			G_avg -= G_sum[x - radius];
+			B_avg -= B_sum[x - radius];
+		}
+
+		// Slide the column sums down a row
+		if (y + 1 < band.end()) {
+			const Uint32* row_old = lines.row(y - radius);
+			const Uint32* row_new = band.row(y + radius + 1);
 
-			image_src.put_pixel(x, y, pixel_dst);
+			for (int x = 0; x < width; x++) {
+				R_sum[x] += RGB_to_red(row_new[x]) - RGB_to_red(row_old[x]);
+				G_sum[x] += RGB_to_green(row_new[x]) - RGB_to_green(row_old[x]);
+				B_sum[x] += RGB_to_blue(row_new[x]) - RGB_to_blue(row_old[x]);
+			}
+
+			// Reuses the slot of the row that just left the neighborhood
+			lines.push(y + radius + 1, row_new);
 		}
 	}
 }
 
-void invert(image_io& image_src) {
+void smooth_mean(image_io& image_src, int radius) {
+	PROFILE_SCOPE("smooth_mean", (Uint64) image_src.width()*image_src.height());
+
+	int width = image_src.width();
+	int height = image_src.height();
+	int diameter = 2*radius + 1;
+
+	// Skip the outer edges, nothing to do unless a whole neighborhood fits
+	if (radius < 1 || width < diameter || height < diameter) return;
+
+	locker lock(image_src);
+
+	run_bands(image_src, radius, height - radius, radius, 4*diameter, [&](band_rows& band) {
+		smooth_mean_band(band, width, radius);
+	});
+
+	image_src.invalidate_gray();
+}
+
+// 3x3 median filter on whole rows with the vector min/max network of simd_median3_row
+static void smooth_median3(image_io& image_src) {
+	int width = image_src.width();
+	int height = image_src.height();
+
+	if (width < 3 || height < 3) return;
+
 	locker lock(image_src);
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+	run_bands(image_src, 1, height - 1, 1, 16, [&](band_rows& band) {
+		// Copies of the original current and previous rows
+		line_buffer lines(width, 2);
 
-	// Iterate through every pixel
-	for (int x = 0; x < image_src.get_image()->w; x++) {
-		for (int y = 0; y < image_src.get_image()->h; y++) {
-			pixel_src = image_src.get_pixel(x, y);
+		lines.push(band.begin() - 1, band.row(band.begin() - 1));
 
-			// Invert the color
-			pixel_dst = ((255 - ((pixel_src >> 0) & 0xFF)) << 0)
-						| ((255 - ((pixel_src >> 8) & 0xFF)) << 8)
-						| ((255 - ((pixel_src >> 16) & 0xFF)) << 16);
+		// Iterate through every row of the band, skip the outer edges
+		for (int y = band.begin(); y < band.end(); y++) {
+			lines.push(y, band.row(y));
 
-			image_src.put_pixel(x, y, pixel_dst);
+			simd_median3_row(lines.row(y - 1), lines.row(y), band.row(y + 1), band.row_dst(y), width);
 		}
+	});
+
+	image_src.invalidate_gray();
+}
+
+// Add (delta = 1) or remove (delta = -1) a pixel from the fine and coarse histograms of a column
+static inline void column_pixel(Uint8* fine, Uint8* coarse, Uint32 pixel, int delta) {
+	for (int c = 0; c < 3; c++) {
+		Uint8 value = (pixel >> 8*c) & 0xFF;
+
+		fine[256*c + value] += delta;
+		coarse[16*c + (value >> 4)] += delta;
 	}
 }
 
-void smooth_mean(image_io& image_src) {
-	// Create a copy for use in algorithms
-	image_io image_tmp(image_src);
+// histogram += column_in - column_out over n bins
+// The column counts are bytes, which may alias anything, so promise the compiler they don't to let it vectorize
+static inline void histogram_slide(Uint16* __restrict__ histogram, const Uint8* __restrict__ column_in, const Uint8* __restrict__ column_out, int n) {
+	for (int i = 0; i < n; i++) histogram[i] += column_in[i] - column_out[i];
+}
 
-	locker lock(image_src);
-	locker lock_tmp(image_tmp);
+static inline void histogram_add(Uint16* __restrict__ histogram, const Uint8* __restrict__ column, int n) {
+	for (int i = 0; i < n; i++) histogram[i] += column[i];
+}
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+// Median of a (2*radius + 1) square neighborhood with the constant time algorithm of Perreault and Hebert
+// Every column keeps a histogram of the rows in the neighborhood, with 256 fine and 16 coarse bins per channel
+// The neighborhood histogram slides along a row by adding one column histogram and removing another
+// Only its coarse bins are kept current, a group of 16 fine bins is brought up to date when the median lands in it
+static void smooth_median_band(band_rows& band, int width, int radius) {
+	int diameter = 2*radius + 1;
 
-	// Variable to hold the pixel average throughout the neighborhood
-	int R_avg;
-	int G_avg;
-	int B_avg;
+	// Copies of the original rows in the neighborhood, the ones above the current row get overwritten
+	line_buffer lines(width, diameter);
 
-	// Iterate through every pixel, skip the outer edges
-	for (int x = 1; x < image_tmp.get_image()->w - 1; x++) {
-		for (int y = 1; y < image_tmp.get_image()->h - 1; y++) {
-			// Variable to hold the pixel average throughout the neighborhood
-			R_avg = G_avg = B_avg = 0;
-
-			// Iterate through the neighborhood
-			for (int u = -1; u + 1 < 3; u++) {
-				for (int v = -1; v + 1 < 3; v++) {
-					pixel_src = image_tmp.get_pixel(x + u, y + v);
-
-					// Iterate through the 9 pixels in the neighborhood
-					// Each has an equal weight of 1/9
-					R_avg += ((pixel_src >> 0) & 0xFF);
-					G_avg += ((pixel_src >> 8) & 0xFF);
-					B_avg += ((pixel_src >> 16) & 0xFF);
-				}
-			}
+	// Histograms of each column over the rows in the neighborhood
+	// The coarse bins are stored apart so sliding them along a row stays in cache
+	vector<Uint8> column_fine((size_t) width*3*256, 0);
+	vector<Uint8> column_coarse((size_t) width*3*16, 0);
 
-			// Pack the color averages back into a single pixel
-			pixel_dst = (R_avg/9 << 0)
-						| (G_avg/9 << 8)
-						| (B_avg/9 << 16);
+	for (int y = band.begin() - radius; y <= band.begin() + radius; y++) {
+		const Uint32* row_src = band.row(y);
+
+		lines.push(y, row_src);
 
-			image_src.put_pixel(x, y, pixel_dst);
+		for (int x = 0; x < width; x++) {
+			column_pixel(&column_fine[(size_t) x*3*256], &column_coarse[(size_t) x*3*16], row_src[x], 1);
 		}
 	}
-}
 
-void smooth_median(image_io& image_src) {
-	// Create a copy for use in algorithms
-	image_io image_tmp(image_src);
+	// The median is the middle value of the sorted neighborhood
+	int rank = (diameter*diameter + 1)/2;
 
-	locker lock(image_src);
-	locker lock_tmp(image_tmp);
+	// Histogram of the neighborhood
+	Uint16 fine[3*256];
+	Uint16 coarse[3*16];
+	// Column each group of 16 fine bins was last brought up to date at
+	int fine_x[3*16];
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+	// Iterate through every pixel of the band, skip the outer edges
+	for (int y = band.begin(); y < band.end(); y++) {
+		Uint32* row_dst = band.row_dst(y);
 
-	int R_med;
-	int G_med;
-	int B_med;
+		// Coarse bins of the first neighborhood in the row
+		memset(coarse, 0, sizeof(coarse));
 
-	int R_list[9];
-	int G_list[9];
-	int B_list[9];
+		for (int x = 0; x < diameter; x++) {
+			histogram_add(coarse, &column_coarse[(size_t) x*3*16], 3*16);
+		}
 
-	// Iterate through every pixel, skip the outer edges
-	for (int x = 1; x < image_tmp.get_image()->w - 1; x++) {
-		for (int y = 1; y < image_tmp.get_image()->h - 1; y++) {
-			// Iterate through the neighborhood
-			for (int u = -1; u + 1 < 3; u++) {
-				for (int v = -1; v + 1 < 3; v++) {
-					pixel_src = image_tmp.get_pixel(x + u, y + v);
-
-					// Iterate through the 9 pixels in the neighborhood
-					R_list[(u + 1) + 3*(v + 1)] = ((pixel_src >> 0) & 0xFF);
-					G_list[(u + 1) + 3*(v + 1)] = ((pixel_src >> 8) & 0xFF);
-					B_list[(u + 1) + 3*(v + 1)] = ((pixel_src >> 16) & 0xFF);
+		// None of the fine bins are valid yet
+		for (int i = 0; i < 3*16; i++) fine_x[i] = -diameter;
+
+		for (int x = radius; x < width - radius; x++) {
+			Uint8 median[3];
+
+			for (int c = 0; c < 3; c++) {
+				// Find the coarse bin holding the median
+				int sum = 0;
+				int group = 16*c;
+
+				while (sum + coarse[group] < rank) sum += coarse[group++];
+
+				Uint16* fine_group = &fine[16*group];
+
+				// Bring its fine bins up to date, either sliding them along or summing the columns from scratch
+				if (2*(x - fine_x[group]) < diameter) {
+					for (int x_step = fine_x[group] + 1; x_step <= x; x_step++) {
+						histogram_slide(fine_group,
+										&column_fine[(size_t) (x_step + radius)*3*256 + 16*group],
+										&column_fine[(size_t) (x_step - radius - 1)*3*256 + 16*group], 16);
+					}
 				}
-			}
+				else {
+					memset(fine_group, 0, 16*sizeof(Uint16));
+
+					for (int x_column = x - radius; x_column <= x + radius; x_column++) {
+						histogram_add(fine_group, &column_fine[(size_t) x_column*3*256 + 16*group], 16);
+					}
+				}
+
+				fine_x[group] = x;
 
-			// Sort the lists
-			std::sort(R_list, R_list + 9);
-			std::sort(G_list, G_list + 9);
-			std::sort(B_list, B_list + 9);
+				// Find the median within the coarse bin
+				int value = 0;
 
-			// Choose the middle value
-			R_med = R_list[4];
-			G_med = G_list[4];
-			B_med = B_list[4];
+				while (sum + fine_group[value] < rank) sum += fine_group[value++];
+
+				median[c] = 16*(group - 16*c) + value;
+			}
 
 			// Pack the color medians back into a single pixel
-			pixel_dst = (R_med << 0)
-						| (G_med << 8)
-						| (B_med << 16);
+			row_dst[x] = pack_RGB(median[0], median[1], median[2]);
+
+			// Slide the coarse bins one column right
+			if (x + radius + 1 < width) {
+				histogram_slide(coarse,
+								&column_coarse[(size_t) (x + radius + 1)*3*16],
+								&column_coarse[(size_t) (x - radius)*3*16], 3*16);
+			}
+		}
 
-			image_src.put_pixel(x, y, pixel_dst);
+		// Slide the column histograms down a row
+		if (y + 1 < band.end()) {
+			const Uint32* row_old = lines.row(y - radius);
+			const Uint32* row_new = band.row(y + radius + 1);
+
+			for (int x = 0; x < width; x++) {
+				column_pixel(&column_fine[(size_t) x*3*256], &column_coarse[(size_t) x*3*16], row_old[x], -1);
+				column_pixel(&column_fine[(size_t) x*3*256], &column_coarse[(size_t) x*3*16], row_new[x], 1);
+			}
+
+			// Reuses the slot of the row that just left the neighborhood
+			lines.push(y + radius + 1, row_new);
 		}
 	}
 }
 
-void hist_eq(image_io& image_src) {
+void smooth_median(image_io& image_src, int radius) {
+	PROFILE_SCOPE("smooth_median", (Uint64) image_src.width()*image_src.height());
+
+	// The common 3x3 case has a faster dedicated path
+	if (radius == 1) {
+		smooth_median3(image_src);
+
+		return;
+	}
+
+	// Column counts are 8-bit and neighborhood counts 16-bit, which holds up to a 255x255 neighborhood
+	if (radius > 127) radius = 127;
+
+	int width = image_src.width();
+	int height = image_src.height();
+	int diameter = 2*radius + 1;
+
+	// Skip the outer edges, nothing to do unless a whole neighborhood fits
+	if (radius < 1 || width < diameter || height < diameter) return;
+
 	locker lock(image_src);
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+	run_bands(image_src, radius, height - radius, radius, 4*diameter, [&](band_rows& band) {
+		smooth_median_band(band, width, radius);
+	});
 
-	Uint32 red_level_sum[256];
-	Uint32 green_level_sum[256];
-	Uint32 blue_level_sum[256];
+	image_src.invalidate_gray();
+}
 
-	long int red_level_integral[256];
-	long int green_level_integral[256];
-	long int blue_level_integral[256];
+void hist_eq(image_io& image_src) {
+	PROFILE_SCOPE("hist_eq", (Uint64) image_src.width()*image_src.height());
 
-	Uint8 red_value, green_value, blue_value;
-	Uint32 red_value_unscaled, green_value_unscaled, blue_value_unscaled;
-	Uint32 red_value_scaled, green_value_scaled, blue_value_scaled;
+	point_ops ops;
 
-	for (int i = 0; i <= 255; i++) {
-		red_level_sum[i] = 0;
-		green_level_sum[i] = 0;
-		blue_level_sum[i] = 0;
+	// Measure the histogram and build the transfer function, then apply it
+	ops.add_hist_eq(image_src);
+	ops.apply(image_src);
+}
 
-		red_level_integral[i] = 0;
-		green_level_integral[i] = 0;
-		blue_level_integral[i] = 0;
-	}
+// Where each pixel along an axis of size pixels falls between the centers of tiles tiles
+// Pixels between two centers blend the tiles on either side, the weight of the upper one is in 1/256ths
+// Past the outermost centers only the nearest tile applies
+static void tile_weights(int size, int tiles, vector<int>& tile_low, vector<int>& tile_high, vector<int>& weight_high) {
+	// Positions are doubled to keep the centers whole numbers
+	auto center = [&](int t) { return (int) ((long) size*t/tiles + (long) size*(t + 1)/tiles); };
+
+	int t = 0;
 
-	// Iterate through every pixel and measure the intensity
-	for (int x = 0; x < image_src.get_image()->w; x++) {
-		for (int y = 0; y < image_src.get_image()->h; y++) {
-			pixel_src = image_src.get_pixel(x, y);
+	for (int i = 0; i < size; i++) {
+		int position = 2*i + 1;
 
-			red_value = RGB_to_red(pixel_src);
-			green_value = RGB_to_green(pixel_src);
-			blue_value = RGB_to_blue(pixel_src);
+		while (t + 1 < tiles && center(t + 1) <= position) t++;
 
-			// Increment the count of that intensity
-			// This is data for the histogram
-			red_level_sum[red_value] += 1;
-			green_level_sum[green_value] += 1;
-			blue_level_sum[blue_value] += 1;
+		if (position <= center(t) || t + 1 == tiles) {
+			tile_low[i] = tile_high[i] = t;
+			weight_high[i] = 0;
+		}
+		else {
+			tile_low[i] = t;
+			tile_high[i] = t + 1;
+			weight_high[i] = 256*(position - center(t))/(center(t + 1) - center(t));
 		}
 	}
+}
 
-	// Compute the first term of the integral
-	red_level_integral[0] = red_level_sum[0];
-	green_level_integral[0] = green_level_sum[0];
-	blue_level_integral[0] = blue_level_sum[0];
+// Each tile gets a transfer function from its own clipped histogram, every pixel then blends the ones of the four tiles around it
+// The tiles are counted in parallel and the blending is a single pass, so the cost doesn't depend on the size of the tiles
+void hist_eq_adaptive(image_io& image_src, int tiles, double clip_limit) {
+	PROFILE_SCOPE("hist_eq_adaptive", (Uint64) image_src.width()*image_src.height());
 
-	// Compute the integral
-	for (int j = 1; j <= 255; j++) {
-		// Integrate over the gray value intensity levels
-		red_level_integral[j] = (red_level_sum[j] + red_level_integral[j - 1]);
-		green_level_integral[j] = (green_level_sum[j] + green_level_integral[j - 1]);
-		blue_level_integral[j] = (blue_level_sum[j] + blue_level_integral[j - 1]);
-	}
+	int width = image_src.width();
+	int height = image_src.height();
 
-	// Iterate through every pixel and adjust the intensity
-	for (int x = 0; x < image_src.get_image()->w; x++) {
-		for (int y = 0; y < image_src.get_image()->h; y++) {
-			pixel_src = image_src.get_pixel(x, y);
+	if (width < 1 || height < 1) return;
 
-			// Separate into the red/green/blue intensities
-			red_value = RGB_to_red(pixel_src);
-			green_value = RGB_to_green(pixel_src);
-			blue_value = RGB_to_blue(pixel_src);
+	// Every tile needs at least one pixel
+	tiles = max(min(tiles, min(width, height)), 1);
 
-			// Use the integral as the transfer function of each pixel
-			red_value_unscaled = red_level_integral[red_value];
-			green_value_unscaled = green_level_integral[green_value];
-			blue_value_unscaled = blue_level_integral[blue_value];
+	locker lock(image_src);
 
-			red_value_scaled = 255.0*red_value_unscaled/((double) red_level_integral[255]);
-			green_value_scaled = 255.0*green_value_unscaled/((double) green_level_integral[255]);
-			blue_value_scaled = 255.0*blue_value_unscaled/((double) blue_level_integral[255]);
+	// Tile t covers [size*t/tiles, size*(t + 1)/tiles) along each axis
+	vector<array<array<Uint8, 256>, 3>> luts(tiles*tiles);
 
-			// Pack the color averages back into a single pixel
-			pixel_dst = pack_RGB(red_value_scaled,
-										green_value_scaled,
-										blue_value_scaled);
+	parallel_for(tiles*tiles, [&](int i) {
+		int x_begin = (long) width*(i % tiles)/tiles;
+		int x_end = (long) width*(i % tiles + 1)/tiles;
+		int y_begin = (long) height*(i/tiles)/tiles;
+		int y_end = (long) height*(i/tiles + 1)/tiles;
+
+		luts[i] = histogram(image_src, x_begin, y_begin, x_end - x_begin, y_end - y_begin).equalization(clip_limit);
+	});
+
+	vector<int> tile_left(width), tile_right(width), weight_right(width);
+	vector<int> tile_top(height), tile_bottom(height), weight_bottom(height);
+
+	tile_weights(width, tiles, tile_left, tile_right, weight_right);
+	tile_weights(height, tiles, tile_top, tile_bottom, weight_bottom);
 
-			// Write to the image
-			image_src.put_pixel(x, y, pixel_dst);
+	run_bands(image_src, 0, height, 0, 16, [&](band_rows& band) {
+		for (int y = band.begin(); y < band.end(); y++) {
+			const array<array<Uint8, 256>, 3>* luts_top = &luts[tile_top[y]*tiles];
+			const array<array<Uint8, 256>, 3>* luts_bottom = &luts[tile_bottom[y]*tiles];
+			int weight_y = weight_bottom[y];
+
+			Uint32* row_dst = band.row_dst(y);
+
+			for (int x = 0; x < width; x++) {
+				int left = tile_left[x];
+				int right = tile_right[x];
+				int weight_x = weight_right[x];
+
+				Uint32 pixel_src = row_dst[x];
+				Uint32 pixel_dst = 0;
+
+				for (int c = 0; c < 3; c++) {
+					Uint8 level = (pixel_src >> 8*c) & 0xFF;
+
+					int value_top = luts_top[left][c][level]*(256 - weight_x) + luts_top[right][c][level]*weight_x;
+					int value_bottom = luts_bottom[left][c][level]*(256 - weight_x) + luts_bottom[right][c][level]*weight_x;
+
+					// Round back down from 1/65536ths
+					pixel_dst |= ((Uint32) (value_top*(256 - weight_y) + value_bottom*weight_y + (1 << 15)) >> 16) << 8*c;
+				}
+
+				row_dst[x] = pixel_dst;
+			}
 		}
-	}
+	});
+
+	image_src.invalidate_gray();
 }
 
 // Convert an image into a binary (black/white) image splitting at the threshold. All pixels equal to or greater than the threshold will be turned white, all pixels below will be black
 void threshold(image_io& image_src, Uint32 threshold) {
-	locker lock(image_src);
+	PROFILE_SCOPE("threshold", (Uint64) image_src.width()*image_src.height());
+
+	point_ops ops;
+
+	ops.add_threshold(threshold);
+	ops.apply(image_src);
+}
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
-	Uint32 gray_value, bw_value;
+void threshold(image_io& image_src, Uint32 threshold, binary_image& binary_dst) {
+	PROFILE_SCOPE("threshold", (Uint64) image_src.width()*image_src.height());
 
-	// Iterate through every pixel
-	for (int x = 0; x < image_src.get_image()->w; x++) {
-		gray_value = 0;
+	point_ops ops;
 
-		for (int y = 0; y < image_src.get_image()->h; y++) {
-			pixel_src = image_src.get_pixel(x, y);
+	ops.add_threshold(threshold);
+	ops.apply(image_src, binary_dst);
+}
+
+// Sobel masks in the x and y directions
+typedef fixed_kernel<3, 3,
+	-1, 0, 1,
+	-2, 0, 2,
+	-1, 0, 1> sobel_mask_x;
+
+typedef fixed_kernel<3, 3,
+	-1, -2, -1,
+	0, 0, 0,
+	1, 2, 1> sobel_mask_y;
 
-			// Get the gray value of each pixel
-			gray_value = RGB_to_gray(pixel_src);
+// Laplace mask
+typedef fixed_kernel<3, 3,
+	0, 1, 0,
+	1, -4, 1,
+	0, 1, 0> laplacian_mask;
 
-			bw_value = (gray_value >= threshold)?0xFF:0x00;
+static_assert(sobel_mask_x::separable() && sobel_mask_y::separable() && !laplacian_mask::separable(), "Sobel masks are separable and the Laplace mask isn't");
 
-			pixel_dst = pack_RGB(bw_value, bw_value, bw_value);
+// Gray pixels of a row of gradients, gx and gy being the sums of the x and y masks
+// Magnitudes past 255 saturate, the largest gradient of 8-bit values is about 1442
 
-			image_src.put_pixel(x, y, pixel_dst);
+// Square roots rounded down of every sum of squares up to 255^2, the largest that doesn't saturate
+static const vector<Uint8>& square_roots() {
+	static const vector<Uint8> roots = []() {
+		vector<Uint8> table(255*255 + 1);
+
+		for (int root = 0; root < 256; root++) {
+			for (int square = root*root; square < (root + 1)*(root + 1) && square <= 255*255; square++) table[square] = root;
 		}
+
+		return table;
+	}();
+
+	return roots;
+}
+
+// sqrt(gx^2 + gy^2), rounded down like the double precision sqrt was
+static void sobel_l2_row(const int* sums_x, const int* sums_y, Uint32* row_dst, int begin, int end) {
+	const Uint8* roots = square_roots().data();
+
+	for (int x = begin; x < end; x++) {
+		Uint8 gray_value = roots[min(sums_x[x]*sums_x[x] + sums_y[x]*sums_y[x], 255*255)];
+
+		row_dst[x] = pack_RGB(gray_value, gray_value, gray_value);
+	}
+}
+
+// |gx| + |gy|
+static void sobel_l1_row(const int* sums_x, const int* sums_y, Uint32* row_dst, int begin, int end) {
+	for (int x = begin; x < end; x++) {
+		Uint8 gray_value = min(abs(sums_x[x]) + abs(sums_y[x]), 255);
+
+		row_dst[x] = pack_RGB(gray_value, gray_value, gray_value);
+	}
+}
+
+// Angles of the first octant in 256ths of a turn, by the slope in 1024ths
+#define OCTANT_STEPS 1024
+
+static const array<Uint8, OCTANT_STEPS + 1>& octant_angles() {
+	static const array<Uint8, OCTANT_STEPS + 1> angles = []() {
+		array<Uint8, OCTANT_STEPS + 1> table;
+
+		for (int k = 0; k <= OCTANT_STEPS; k++) table[k] = lrint(atan((double) k/OCTANT_STEPS)*128/M_PI);
+
+		return table;
+	}();
+
+	return angles;
+}
+
+// Direction of the gradient in 256ths of a turn, 0 pointing right and 64 down, 0 where there's no gradient
+// The angle of the first octant is looked up from the smaller of |gx| and |gy| over the larger and mirrored into place
+static void sobel_orientation_row(const int* sums_x, const int* sums_y, Uint32* row_dst, int begin, int end) {
+	const array<Uint8, OCTANT_STEPS + 1>& angles = octant_angles();
+
+	for (int x = begin; x < end; x++) {
+		int gx = sums_x[x];
+		int gy = sums_y[x];
+		int ax = abs(gx);
+		int ay = abs(gy);
+
+		int angle = angles[(int) ((float) min(ax, ay)/max(max(ax, ay), 1)*OCTANT_STEPS + 0.5f)];
+
+		if (ay > ax) angle = 64 - angle;
+		if (gx < 0) angle = 128 - angle;
+		if (gy < 0) angle = -angle;
+
+		Uint8 gray_value = angle & 255;
+
+		row_dst[x] = pack_RGB(gray_value, gray_value, gray_value);
 	}
 }
 
 // Edge detection using the Sobel Gradient
-void sobel_gradient(image_io& image_src) {
-	// Create a copy for use in algorithms
-	image_io image_tmp(image_src);
+void sobel_gradient(image_io& image_src, sobel_output output) {
+	PROFILE_SCOPE("sobel_gradient", (Uint64) image_src.width()*image_src.height());
 
-	locker lock(image_src);
-	locker lock_tmp(image_tmp);
+	int width = image_src.width();
+	int height = image_src.height();
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+	if (width < 3 || height < 3) return;
 
-	// Get the gray value of each pixel
-	Uint32 gray_value;
+	locker lock(image_src);
+
+	// The output is picked once, each row then runs a loop without branches
+	void (*output_row)(const int*, const int*, Uint32*, int, int) =
+		(output == SOBEL_L1) ? sobel_l1_row : (output == SOBEL_ORIENTATION) ? sobel_orientation_row : sobel_l2_row;
 
-	int gray_value_sum_x, gray_value_sum_y, gray_value_sum_xy;
+	// Gray values of the original pixels, the bands only ever write the image so they don't need copies of any rows
+	const Uint8* gray_src = image_src.gray();
 
 	// Iterate through every pixel, skip the outer edges
-	for (int x = 1; x < image_tmp.get_image()->w - 1; x++) {
-		for (int y = 1; y < image_tmp.get_image()->h - 1; y++) {
-			// Variable to hold the pixel average throughout the neighborhood
-			gray_value_sum_x = gray_value_sum_y = gray_value_sum_xy = 0;
-
-			// Sobel mask in the x-direction
-			static int sobel_mask_x[] = {-1, 0, 1,
-										-2, 0, 2,
-										-1, 0, 1};
-
-			// Sobel mask in the y-direction
-			static int sobel_mask_y[] = {-1, -2, -1,
-										0, 0, 0,
-										1, 2, 1};
-
-			// Iterate through the neighborhood
-			for (int u = -1; u + 1 < 3; u++) {
-				for (int v = -1; v + 1 < 3; v++) {
-					pixel_src = image_tmp.get_pixel(x + u, y + v);
-
-					// Get the gray value of each pixel
-					gray_value = RGB_to_gray(pixel_src);
-
-					// Iterate through the 9 pixels in the neighborhood
-					// Each has a weight determined by the Sobel mask
-					gray_value_sum_x += sobel_mask_x[(u + 1) + 3*(v + 1)]*gray_value;
-					gray_value_sum_y += sobel_mask_y[(u + 1) + 3*(v + 1)]*gray_value;
-				}
-			}
+	run_bands(image_src, 1, height - 1, 0, 16, [&](band_rows& band) {
+		// Sums of the x and y masks along a row, both are separable so they're integer adds over whole rows
+		vector<int> sums_x(width), sums_y(width), scratch(width);
 
-			// Combine the x and y gradients with Pythagorean theorem
-			gray_value_sum_xy = sqrt(pow(gray_value_sum_x, 2) + pow(gray_value_sum_y, 2));
+		for (int y = band.begin(); y < band.end(); y++) {
+			// The three gray rows covering the neighborhood
+			const Uint8* rows_src[3] = {gray_src + (size_t) (y - 1)*width, gray_src + (size_t) y*width, gray_src + (size_t) (y + 1)*width};
 
-			// Pack the color averages back into a single pixel
-			pixel_dst = pack_RGB(gray_value_sum_xy, gray_value_sum_xy, gray_value_sum_xy);
+			convolve_row<sobel_mask_x>(rows_src, width, sums_x.data(), scratch.data());
+			convolve_row<sobel_mask_y>(rows_src, width, sums_y.data(), scratch.data());
 
-			image_src.put_pixel(x, y, pixel_dst);
+			output_row(sums_x.data(), sums_y.data(), band.row_dst(y), 1, width - 1);
 		}
-	}
+	});
+
+	image_src.invalidate_gray();
 }
 
 // Edge detection using the Sobel Gradient
 void laplacian(image_io& image_src) {
-	// Create a copy for use in algorithms
-	image_io image_tmp(image_src);
+	PROFILE_SCOPE("laplacian", (Uint64) image_src.width()*image_src.height());
 
-	locker lock(image_src);
-	locker lock_tmp(image_tmp);
+	int width = image_src.width();
+	int height = image_src.height();
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+	if (width < 3 || height < 3) return;
+
+	locker lock(image_src);
 
-	// Get the gray value of each pixel
-	Uint32 gray_value;
-	int gray_value_sum;
+	// Gray values of the original pixels, the bands only ever write the image so they don't need copies of any rows
+	const Uint8* gray_src = image_src.gray();
 
 	// Iterate through every pixel, skip the outer edges
-	for (int x = 1; x < image_tmp.get_image()->w - 1; x++) {
-		for (int y = 1; y < image_tmp.get_image()->h - 1; y++) {
-			// Variable to hold the pixel average throughout the neighborhood
-			gray_value_sum = 0;
-
-			// Laplace mask
-			static int laplacian_mask[] = {0, 1, 0,
-											1, -4, 1,
-											0, 1, 0};
-
-			// Iterate through the neighborhood
-			for (int u = -1; u + 1 < 3; u++) {
-				for (int v = -1; v + 1 < 3; v++) {
-					pixel_src = image_tmp.get_pixel(x + u, y + v);
-
-					// Get the gray value of each pixel
-					gray_value = RGB_to_gray(pixel_src);
-
-					// Iterate through the 9 pixels in the neighborhood
-					gray_value_sum += laplacian_mask[(u + 1) + 3*(v + 1)]*gray_value;
-				}
-			}
+	run_bands(image_src, 1, height - 1, 0, 16, [&](band_rows& band) {
+		vector<int> sums(width), scratch(width);
 
-			// Pack the color averages back into a single pixel
-			pixel_dst = pack_RGB(gray_value_sum, gray_value_sum, gray_value_sum);
+		for (int y = band.begin(); y < band.end(); y++) {
+			// The three gray rows covering the neighborhood
+			const Uint8* rows_src[3] = {gray_src + (size_t) (y - 1)*width, gray_src + (size_t) y*width, gray_src + (size_t) (y + 1)*width};
+			Uint32* row_dst = band.row_dst(y);
+
+			convolve_row<laplacian_mask>(rows_src, width, sums.data(), scratch.data());
+
+			// Pack the sums back into single pixels
+			for (int x = 1; x < width - 1; x++) row_dst[x] = pack_RGB(sums[x], sums[x], sums[x]);
+		}
+	});
+
+	image_src.invalidate_gray();
+}
+
+// Mask of the columns off the outer edges of a black and white image
+static vector<Uint64> inner_columns(const binary_image& binary_src) {
+	vector<Uint64> inner(binary_src.words(), 0);
+
+	for (int x = 1; x < binary_src.width() - 1; x++) {
+		inner[x >> 6] |= ((Uint64) 1) << (x & 63);
+	}
+
+	return inner;
+}
+
+// Bits set where the pixel and both its horizontal neighbours are set in bits (and = true), or where any of them is (and = false)
+// Neighbours past the ends of the row count as clear
+static inline Uint64 horizontal_3(const Uint64* bits, int w, int words, bool and_op) {
+	Uint64 prev = (w > 0) ? bits[w - 1] : 0;
+	Uint64 next = (w + 1 < words) ? bits[w + 1] : 0;
 
-			image_src.put_pixel(x, y, pixel_dst);
+	// Bit x of left holds bit x - 1, bit x of right holds bit x + 1
+	Uint64 left = (bits[w] << 1) | (prev >> 63);
+	Uint64 right = (bits[w] >> 1) | (next << 63);
+
+	return and_op ? (bits[w] & left & right) : (bits[w] | left | right);
+}
+
+// Position of the first set (set = true) or clear bit at or after x in a row of bits, width if there is none
+static int next_bit(const Uint64* bits, int x, int width, bool set) {
+	int words = (width + 63)/64;
+
+	if (x >= width) return width;
+
+	int w = x >> 6;
+	Uint64 word = (set ? bits[w] : ~bits[w]) & (~((Uint64) 0) << (x & 63));
+
+	while (!word) {
+		if (++w >= words) return width;
+
+		word = set ? bits[w] : ~bits[w];
+	}
+
+	return min(64*w + __builtin_ctzll(word), width);
+}
+
+// Set the bits [begin, end) of a row of bits
+static void set_bits(Uint64* bits, int begin, int end) {
+	while (begin < end) {
+		int count = min(64 - (begin & 63), end - begin);
+		Uint64 mask = (count == 64) ? ~((Uint64) 0) : ((((Uint64) 1) << count) - 1) << (begin & 63);
+
+		bits[begin >> 6] |= mask;
+		begin += count;
+	}
+}
+
+// Set every bit within distance n of a set bit, the neighborhood being a (2n + 1) square clipped to the image
+// Along the rows each run of set bits grows by n on both sides, never filling the same bits twice
+// Down the columns it's the running OR of van Herk and Gil-Werman: the rows are cut into blocks of 2n + 1,
+// and every window is the OR to the end of the block it starts in with the OR from the start of the block it ends in
+// Either way the cost doesn't depend on n
+static void spread_bits(binary_image& marks, int n) {
+	int width = marks.width();
+	int height = marks.height();
+	int words = marks.words();
+
+	// Past the size of the image the result is the same
+	n = min(n, max(width, height));
+
+	if (n < 1) return;
+
+	vector<Uint64> row_tmp(words);
+
+	for (int y = 0; y < height; y++) {
+		Uint64* row = marks.row(y);
+		int filled = 0;
+
+		fill(row_tmp.begin(), row_tmp.end(), 0);
+
+		for (int x = next_bit(row, 0, width, true); x < width; x = next_bit(row, x, width, true)) {
+			int end = next_bit(row, x, width, false);
+
+			set_bits(row_tmp.data(), max(max(x - n, 0), filled), min(end + n, width));
+
+			filled = min(end + n, width);
+			x = end;
+		}
+
+		copy(row_tmp.begin(), row_tmp.end(), row);
+	}
+
+	int block = 2*n + 1;
+
+	// ORs of each row with the ones before it in its block, and with the ones after it
+	vector<Uint64> prefix((size_t) words*height);
+	vector<Uint64> suffix((size_t) words*height);
+
+	for (int y = 0; y < height; y++) {
+		const Uint64* row = marks.row(y);
+		Uint64* row_prefix = &prefix[(size_t) y*words];
+
+		for (int w = 0; w < words; w++) {
+			row_prefix[w] = (y % block == 0) ? row[w] : row_prefix[w - words] | row[w];
+		}
+	}
+
+	for (int y = height - 1; y >= 0; y--) {
+		const Uint64* row = marks.row(y);
+		Uint64* row_suffix = &suffix[(size_t) y*words];
+
+		for (int w = 0; w < words; w++) {
+			row_suffix[w] = (y % block == block - 1 || y == height - 1) ? row[w] : row_suffix[w + words] | row[w];
+		}
+	}
+
+	for (int y = 0; y < height; y++) {
+		int top = max(y - n, 0);
+		int bottom = min(y + n, height - 1);
+		Uint64* row = marks.row(y);
+		const Uint64* row_suffix = &suffix[(size_t) top*words];
+		const Uint64* row_prefix = &prefix[(size_t) bottom*words];
+
+		for (int w = 0; w < words; w++) {
+			// A window inside a single block was clipped by the image, and starts at the block or ends at the image
+			if (top/block != bottom/block) row[w] = row_suffix[w] | row_prefix[w];
+			else if (top % block == 0) row[w] = row_prefix[w];
+			else row[w] = row_suffix[w];
 		}
 	}
 }
 
+// Marks of the black pixels off the outer edges, the ones dilation spreads from
+static binary_image inner_black(const binary_image& binary_src) {
+	binary_image marks(binary_src.width(), binary_src.height());
+	vector<Uint64> inner = inner_columns(binary_src);
+
+	for (int y = 1; y < binary_src.height() - 1; y++) {
+		for (int w = 0; w < binary_src.words(); w++) marks.row(y)[w] = binary_src.row(y)[w] & inner[w];
+	}
+
+	return marks;
+}
+
+// Marks of the pixels that aren't black, the ones erosion spreads from
+static binary_image not_black(const binary_image& binary_src) {
+	binary_image marks(binary_src.width(), binary_src.height());
+
+	for (int y = 0; y < binary_src.height(); y++) {
+		for (int w = 0; w < binary_src.words(); w++) marks.row(y)[w] = ~binary_src.row(y)[w];
+
+		// Keep the bits past the width clear
+		if (binary_src.width() % 64) marks.row(y)[binary_src.words() - 1] &= (((Uint64) 1) << (binary_src.width() % 64)) - 1;
+	}
+
+	return marks;
+}
+
 // Degrade the image by n pixels
 // Erodes away black objects
 // Doesn't like pngs created by MS Paint
+// n steps at once: a pixel off the outer edges turns white if any pixel within n of it isn't black
 void erosion(image_io& image_src, int erode_n) {
+	PROFILE_SCOPE("erosion", (Uint64) image_src.width()*image_src.height());
+
+	int width = image_src.width();
+	int height = image_src.height();
+
+	if (erode_n < 1 || width < 3 || height < 3) return;
+
+	binary_image marks = not_black(binary_image(image_src));
+	spread_bits(marks, erode_n);
+
 	locker lock(image_src);
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
-	Uint8 gray_value;
+	// Iterate through every pixel, skip the outer edges
+	run_bands(image_src, 1, height - 1, 0, 16, [&](band_rows& band) {
+		for (int y = band.begin(); y < band.end(); y++) {
+			Uint32* row_dst = image_src.row(y);
 
-	int erode_flag;
+			for (int x = 1; x < width - 1; x++) {
+				// Change this pixel to white
+				if (marks.get(x, y)) row_dst[x] = pack_RGB(0xFF, 0xFF, 0xFF);
+			}
+		}
+	});
 
-	for (int n = 0; n < erode_n; n++) {
-		// Create a copy for use in algorithms
-		image_io image_tmp(image_src);
-		locker lock_tmp(image_tmp);
+	image_src.invalidate_gray();
+}
 
-		// Iterate through every pixel, skip the outer edges
-		for (int x = 1; x < image_tmp.get_image()->w - 1; x++) {
-			for (int y = 1; y < image_tmp.get_image()->h - 1; y++) {
-				erode_flag = 0;
+// Enlarge the image by n pixels
+// Dilates black
+// n steps at once: a pixel turns black if there's a black pixel off the outer edges within n of it
+void dilation(image_io& image_src, int dilate_n) {
+	PROFILE_SCOPE("dilation", (Uint64) image_src.width()*image_src.height());
 
-				// Iterate through the neighborhood
-				for (int u = -1; u + 1 < 3; u++) {
-					for (int v = -1; v + 1 < 3; v++) {
-						pixel_src = image_tmp.get_pixel(x + u, y + v);
+	int width = image_src.width();
+	int height = image_src.height();
 
-						// Get the gray value of each pixel
-						gray_value = RGB_to_gray(pixel_src);
+	if (dilate_n < 1 || width < 3 || height < 3) return;
 
-						// If pixels in the neighborhood aren't black erode
-						if (gray_value != 0x00) {
-							erode_flag = 1;
+	binary_image marks = inner_black(binary_image(image_src));
+	spread_bits(marks, dilate_n);
 
-							break;
-						}
-					}
-				}
+	locker lock(image_src);
 
-				if (erode_flag) {
-					// Change this pixel to white
-					pixel_dst = pack_RGB(0xFF, 0xFF, 0xFF);
+	run_bands(image_src, 0, height, 0, 16, [&](band_rows& band) {
+		for (int y = band.begin(); y < band.end(); y++) {
+			Uint32* row_dst = image_src.row(y);
 
-					image_src.put_pixel(x, y, pixel_dst);
-				}
+			for (int x = 0; x < width; x++) {
+				if (marks.get(x, y)) row_dst[x] = pack_RGB(0x00, 0x00, 0x00);
 			}
 		}
+	});
+
+	image_src.invalidate_gray();
+}
+
+shape_stats::shape_stats() : area(0), perimeter(0) {
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) M[i][j] = 0;
 	}
 }
 
-// Enlarge the image by n pixels
-// Dilates black
-void dilation(image_io& image_src, int dilate_n) {
-	locker lock(image_src);
+void shape_stats::merge(const shape_stats& other) {
+	area += other.area;
+	perimeter += other.perimeter;
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_dst;
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) M[i][j] += other.M[i][j];
+	}
+}
 
-	Uint8 gray_value;
+std::array<std::array<double, 4>, 4> shape_stats::moments() const {
+	std::array<std::array<double, 4>, 4> moments_double = {0};
 
-	for (int n = 0; n < dilate_n; n++) {
-		// Create a copy for use in algorithms
-		image_io image_tmp(image_src);
-		locker lock_tmp(image_tmp);
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) moments_double[i][j] = (double) M[i][j];
+	}
 
-		// Iterate through every pixel, skip the outer edges
-		for (int x = 1; x < image_tmp.get_image()->w - 1; x++) {
-			for (int y = 1; y < image_tmp.get_image()->h - 1; y++) {
-				pixel_src = image_tmp.get_pixel(x, y);
+	return moments_double;
+}
 
-				// Get the gray value of each pixel
-				gray_value = RGB_to_gray(pixel_src);
+// Add the moments of row y given its sums Si = Ex x^i*(255 - gray(x, y))
+// Only M00 through M03, M10 through M30, M11, M12 and M21 are needed
+static void add_row_moments(Uint128 M[4][4], int y, Uint64 S0, Uint64 S1, Uint64 S2, Uint128 S3) {
+	Uint128 y1 = y;
+	Uint128 y2 = y1*y;
+	Uint128 y3 = y2*y;
+
+	M[0][0] += S0;
+	M[0][1] += S0*y1;
+	M[0][2] += S0*y2;
+	M[0][3] += S0*y3;
+	M[1][0] += S1;
+	M[1][1] += S1*y1;
+	M[1][2] += S1*y2;
+	M[2][0] += S2;
+	M[2][1] += S2*y1;
+	M[3][0] += S3;
+}
 
-				// Pack the color averages back into a single pixel
-				pixel_dst = pack_RGB(0x00, 0x00, 0x00);
+// Shape sums over the rows [y_begin, y_end) of the gray plane of a strip width pixels wide
+// Row 0 of the strip is row y_offset of an image height rows tall, the rows next to the band are read when it has them
+static void shape_band(const Uint8* gray_src, int width, int y_begin, int y_end, int y_offset, int height, shape_stats& stats) {
+	if (y_begin >= y_end) return;
 
-				if (gray_value == 0x00) {
-					// Iterate through the neighborhood
-					for (int u = -1; u + 1 < 3; u++) {
-						for (int v = -1; v + 1 < 3; v++) {
-							// Fill in a 3x3 mask of pixels
-							image_src.put_pixel(x + u, y + v, pixel_dst);
-						}
-					}
-				}
+	// Zero where a pixel and the ones above and below it are all black
+	vector<Uint8> column(width);
+
+	for (int y = y_begin; y < y_end; y++) {
+		const Uint8* gray = gray_src + (size_t) y*width;
+
+		Uint64 S0 = 0, S1 = 0, S2 = 0;
+		Uint128 S3 = 0;
+
+		for (int x = 0; x < width; x++) {
+			// Subtract from 255 to get the moments of the black pixels
+			Uint64 value = 255 - gray[x];
+
+			S0 += value;
+			S1 += value*x;
+			S2 += value*x*x;
+			S3 += (Uint128) (value*x*x)*x;
+		}
+
+		add_row_moments(stats.M, y_offset + y, S0, S1, S2, S3);
+
+		// Skip the outer edges
+		if (y_offset + y > 0 && y_offset + y < height - 1) {
+			int area_sum = 0;
+			int perimeter_sum = 0;
+
+			// Rows above and below, which the strip has for every row off the outer edges
+			const Uint8* above = gray - width;
+			const Uint8* below = gray + width;
+
+			for (int x = 0; x < width; x++) column[x] = above[x] | gray[x] | below[x];
+
+			for (int x = 1; x < width - 1; x++) {
+				area_sum += !gray[x];
+
+				// Erosion turns a pixel white if anything in its 3x3 neighborhood isn't black
+				perimeter_sum += (gray[x] != 255) && (column[x - 1] | column[x] | column[x + 1]);
 			}
+
+			stats.area += area_sum;
+			stats.perimeter += perimeter_sum;
 		}
 	}
 }
 
+shape_stats shape_statistics(image_io& image_src) {
+	return shape_statistics(image_src, 0, image_src.height(), 0, image_src.height());
+}
+
+// The rows are split into bands, each thread sums its own and the sums are merged at the end
+shape_stats shape_statistics(image_io& strip_src, int y_begin, int y_end, int y_offset, int height) {
+	PROFILE_SCOPE("shape_statistics", (Uint64) strip_src.width()*(y_end - y_begin));
+
+	locker lock(strip_src);
+
+	int rows = y_end - y_begin;
+	int count = band_count(rows, 16);
+
+	vector<shape_stats> partials(count);
+
+	const Uint8* gray_src = strip_src.gray();
+
+	parallel_for(count, [&](int i) {
+		shape_band(gray_src, strip_src.width(), y_begin + (long) rows*i/count, y_begin + (long) rows*(i + 1)/count, y_offset, height, partials[i]);
+	});
+
+	shape_stats stats;
+
+	for (const shape_stats& partial : partials) stats.merge(partial);
+
+	return stats;
+}
+
 // Compute the perimeter
 int perimiter(image_io& image_src) {
-	// Create a copy for use in algorithms
-	image_io image_eroded(image_src);
+	return shape_statistics(image_src).perimeter;
+}
 
-	locker lock(image_src);
+// Compute the area
+int area(image_io& image_src) {
+	return shape_statistics(image_src).area;
+}
+
+// A black pixel off the outer edges turns white if any pixel within n of it is white
+void erosion(binary_image& binary_src, int erode_n) {
+	PROFILE_SCOPE("erosion", (Uint64) binary_src.width()*binary_src.height());
+
+	if (erode_n < 1 || binary_src.width() < 3 || binary_src.height() < 3) return;
+
+	binary_image marks = not_black(binary_src);
+	spread_bits(marks, erode_n);
 
-	// Erode the image, take difference between eroded and normal and sum
-	erosion(image_eroded, 1);
+	// Only the pixels off the outer edges change
+	vector<Uint64> inner = inner_columns(binary_src);
+
+	for (int y = 1; y < binary_src.height() - 1; y++) {
+		for (int w = 0; w < binary_src.words(); w++) binary_src.row(y)[w] &= ~(marks.row(y)[w] & inner[w]);
+	}
+}
+
+// A pixel turns black if there's a black pixel off the outer edges within n of it
+void dilation(binary_image& binary_src, int dilate_n) {
+	PROFILE_SCOPE("dilation", (Uint64) binary_src.width()*binary_src.height());
+
+	if (dilate_n < 1 || binary_src.width() < 3 || binary_src.height() < 3) return;
+
+	binary_image marks = inner_black(binary_src);
+	spread_bits(marks, dilate_n);
+
+	for (int y = 0; y < binary_src.height(); y++) {
+		for (int w = 0; w < binary_src.words(); w++) binary_src.row(y)[w] |= marks.row(y)[w];
+	}
+}
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, pixel_src_eroded;
-	Uint32 pixel_src_gray, pixel_src_gray_eroded;
+// Black pixels of row y off the outer edges with a white pixel in their 3x3 neighborhood
+// vertical is scratch space of a word per column
+static int perimeter_row(const binary_image& binary_src, int y, const vector<Uint64>& inner, vector<Uint64>& vertical) {
+	int words = binary_src.words();
 	int perimeter_sum = 0;
 
-	// Iterate through every pixel, skip the outer edges
-	for (int x = 1; x < image_eroded.get_image()->w - 1; x++) {
-		for (int y = 1; y < image_eroded.get_image()->h - 1; y++) {
-			pixel_src = image_src.get_pixel(x, y);
-			pixel_src_eroded = image_eroded.get_pixel(x, y);
+	const Uint64* above = binary_src.row(y - 1);
+	const Uint64* row = binary_src.row(y);
+	const Uint64* below = binary_src.row(y + 1);
 
-			pixel_src_gray = RGB_to_gray(pixel_src);
-			pixel_src_gray_eroded = RGB_to_gray(pixel_src_eroded);
+	for (int w = 0; w < words; w++) vertical[w] = above[w] & row[w] & below[w];
 
-			// If pixels are different they must be part of the perimiter
-			if (abs(pixel_src_gray - pixel_src_gray_eroded)) {
-				perimeter_sum++;
-			}
-		}
+	for (int w = 0; w < words; w++) {
+		perimeter_sum += __builtin_popcountll(row[w] & inner[w] & ~horizontal_3(vertical.data(), w, words, true));
 	}
 
 	return perimeter_sum;
 }
 
-// Compute the area
-int area(image_io& image_src) {
-	locker lock(image_src);
+// These are the pixels a single erosion changes
+int perimiter(const binary_image& binary_src) {
+	PROFILE_SCOPE("perimiter", (Uint64) binary_src.width()*binary_src.height());
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src;
-	Uint32 pixel_src_gray;
-	int area_sum = 0;
+	int height = binary_src.height();
+	int perimeter_sum = 0;
 
-	// Iterate through every pixel
-	for (int x = 1; x < image_src.get_image()->w - 1; x++) {
-		for (int y = 1; y < image_src.get_image()->h - 1; y++) {
-			pixel_src = image_src.get_pixel(x, y);
+	if (binary_src.width() < 3 || height < 3) return 0;
 
-			pixel_src_gray = RGB_to_gray(pixel_src);
+	vector<Uint64> inner = inner_columns(binary_src);
+	vector<Uint64> vertical(binary_src.words());
 
-			// If a pixel is black, add it to the sum
-			if (!pixel_src_gray) {
-				area_sum++;
-			}
+	for (int y = 1; y < height - 1; y++) perimeter_sum += perimeter_row(binary_src, y, inner, vertical);
+
+	return perimeter_sum;
+}
+
+// Black pixels off the outer edges
+int area(const binary_image& binary_src) {
+	PROFILE_SCOPE("area", (Uint64) binary_src.width()*binary_src.height());
+
+	vector<Uint64> inner = inner_columns(binary_src);
+	int area_sum = 0;
+
+	for (int y = 1; y < binary_src.height() - 1; y++) {
+		const Uint64* row = binary_src.row(y);
+
+		for (int w = 0; w < binary_src.words(); w++) {
+			area_sum += __builtin_popcountll(row[w] & inner[w]);
 		}
 	}
 
 	return area_sum;
 }
 
-// Compute the moments
-// Mij = ExEy x^i*y^j*I(x, y)
-std::array<std::array<double, 4>, 4> moment(image_io& image_src) {
-	locker lock(image_src);
+// Black pixels weigh 255 in the moments, white ones nothing
+shape_stats shape_statistics(const binary_image& binary_src) {
+	PROFILE_SCOPE("shape_statistics", (Uint64) binary_src.width()*binary_src.height());
+
+	int width = binary_src.width();
+	int height = binary_src.height();
+
+	shape_stats stats;
+
+	vector<Uint64> inner = inner_columns(binary_src);
+	vector<Uint64> vertical(binary_src.words());
+
+	for (int y = 0; y < height; y++) {
+		const Uint64* row = binary_src.row(y);
+		Uint64 S0 = 0, S1 = 0, S2 = 0;
+		Uint128 S3 = 0;
 
-	// Holds pixel data for reading and writing
-	Uint32 pixel_src, gray_value;
-
-	// Need to compute M00, M01, M02, M03
-	// M10, M20, M30
-	// M11, M12, M21
-	std::array<std::array<double, 4>, 4> M = {0};
-
-	// Iterate through every pixel
-	for (int x = 0; x < image_src.get_image()->w; x++) {
-		for (int y = 0; y < image_src.get_image()->h; y++) {
-			pixel_src = image_src.get_pixel(x, y);
-
-			// Get the gray value of each pixel
-			// Subtract from 255 to moments of the black pixels
-			gray_value = 255 - RGB_to_gray(pixel_src);
-
-			M[0][0] += gray_value;
-			M[0][1] += gray_value*y;
-			M[0][2] += gray_value*y*y;
-			M[0][3] += gray_value*y*y*y;
-			M[1][0] += gray_value*x;
-			M[2][0] += gray_value*x*x;
-			M[3][0] += gray_value*x*x*x;
-			M[1][1] += gray_value*x*y;
-			M[1][2] += gray_value*x*y*y;
-			M[2][1] += gray_value*x*x*y;
+		for (int w = 0; w < binary_src.words(); w++) {
+			// Visit each black pixel
+			for (Uint64 bits = row[w]; bits; bits &= bits - 1) {
+				Uint64 x = 64*w + __builtin_ctzll(bits);
+
+				S0++;
+				S1 += x;
+				S2 += x*x;
+				S3 += (Uint128) (x*x)*x;
+			}
+		}
+
+		add_row_moments(stats.M, y, 255*S0, 255*S1, 255*S2, 255*S3);
+
+		// Skip the outer edges
+		if (y > 0 && y < height - 1 && width >= 3) {
+			for (int w = 0; w < binary_src.words(); w++) stats.area += __builtin_popcountll(row[w] & inner[w]);
+
+			stats.perimeter += perimeter_row(binary_src, y, inner, vertical);
 		}
 	}
 
-	return M;
+	return stats;
+}
+
+// Compute the moments
+// Mij = ExEy x^i*y^j*I(x, y)
+std::array<std::array<double, 4>, 4> moment(image_io& image_src) {
+	return shape_statistics(image_src).moments();
 }
 
 // Compute the centroid from the moment
@@ -729,17 +1260,6 @@ std::array<std::array<double, 2>, 3> eigen(const std::array<std::array<double, 4
 	return eigen;
 }
 
-// Convert from RGB pixel format to gray value
-// gray_value = (0.299*r + 0.587*g + 0.114*b);
-Uint8 RGB_to_gray(Uint32 RGB_pixel) {
-	// This math shouldn't grow greater than 255 so checking for saturation/overflow isn't necessary
-	Uint8 gray_value = .3*((RGB_pixel >> 0) & 0xFF)
-					+ .587*((RGB_pixel >> 8) & 0xFF)
-					+ .114*((RGB_pixel >> 16) & 0xFF);
-
-	return gray_value;
-}
-
 // Return the color components
 Uint8 RGB_to_red(Uint32 RGB_pixel) { return ((RGB_pixel >> 0) & 0xFF); }
 Uint8 RGB_to_green(Uint32 RGB_pixel) { return ((RGB_pixel >> 8) & 0xFF); }